@@ -1,15 +1,48 @@
 #ifndef _ML_H_
 #define _ML_H_
 
+// clock_gettime, posix_memalign, ftruncate, fileno, syscall and MADV_HUGEPAGE are hidden by strict
+// -std=c11 builds, so include ML.h before any system header
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include <pthread.h>
+
 #if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
 #include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+// build with ML_USE_LIBNUMA (and -lnuma) to let AllocPolicy bind memory to NUMA nodes
+#ifdef ML_USE_LIBNUMA
+#include <numa.h>
 #endif
 
 typedef enum {
@@ -32,6 +65,40 @@ typedef struct MATRIX {
     float *data;
 } Matrix;
 
+// number of independent xoshiro128** generators stepped side by side in one Rng,
+// wide enough for the bulk fills to vectorize on AVX2 (8 x 32 bit)
+#define RNG_LANES 8
+
+// explicit random state, give every thread its own one (Rng_new with a different stream)
+typedef struct RNG {
+    uint32_t s[4][RNG_LANES];
+    uint32_t buffer[RNG_LANES];
+    int index;
+} Rng;
+
+// where matrix_new puts its memory, set per thread with ml_set_alloc_policy
+typedef struct ALLOC_POLICY {
+    bool hugePages;  // 2MB aligned and madvise(MADV_HUGEPAGE) for buffers of at least 2MB
+    int node;        // NUMA node to bind to, -1 for no binding
+    bool interleave; // spread pages over all nodes, overrides node
+} AllocPolicy;
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// samples Network_forward_lanes evaluates side by side, one per float of a vector register:
+// one AVX-512 register or two AVX2 ones
+#define NETWORK_LANES 16
+// widest layer the lane evaluation keeps in its stack buffers
+#define LANES_MAX_WIDTH 64
+
+// builds the lane loops once per instruction set and lets the loader pick the widest the cpu has,
+// they never look at floating point exceptions, which lets the compiler turn their clamps into blends
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define ML_LANES_TARGET __attribute__((target_clones("avx512f", "avx2", "default"), optimize("no-trapping-math")))
+#else
+#define ML_LANES_TARGET
+#endif
+
 typedef struct STEP {
     Matrix state;
     float reward;
@@ -40,14 +107,398 @@ typedef struct STEP {
     bool death;
 } Step;
 
+// rewards of `streams` parallel environments in structure of arrays form, time major:
+// index t * streams + e is step t of environment e, streams = 1 for episodes laid end to end
+// every array has steps * streams entries except lastValues
+typedef struct TRAJECTORY {
+    int steps;
+    int streams;
+    float *rewards;
+    float *dones;      // 1 where the episode ended with that step
+    float *values;     // value estimate of every step's state, filled by the caller
+    float *lastValues; // streams entries, value of the state after the last step, 0 if unknown
+    float *returns;
+    float *advantages;
+} Trajectory;
+
+// streams Trajectory_nstep slides its window over together, their state lives on the stack
+#define TRAJECTORY_WINDOW_STREAMS 64
+
+typedef enum {
+    GEMM_NAIVE,
+    GEMM_IKJ,
+    GEMM_BLOCKED,
+} GemmKernel;
+
+// how matrix_dot_plan computes one product: which loop order, tile sizes and how many threads
+typedef struct GEMM_PLAN {
+    GemmKernel kernel;
+    int tileRows;
+    int tileInner;
+    int tileCols;
+    int threads;
+} GemmPlan;
+
+// plans are kept per power of two batch size, 1 to 4096 rows
+#define GEMM_PLAN_BATCHES 13
+
+// environment variable naming the file Network_autotune reads and appends plans to when given NULL
+#define GEMM_PLAN_CACHE_ENV "ML_GEMM_CACHE"
+// name of that file inside the user's cache directory when the variable is not set
+#define GEMM_PLAN_CACHE "ml_gemm_plans.cache"
+
+// fixed set of worker threads that run the tasks of ThreadPool_run
+typedef struct THREAD_POOL {
+    int count;
+    pthread_t *threads;
+    pthread_mutex_t runLock;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t finished;
+    void (*task)(void *arg, int index);
+    void *arg;
+    int tasks;
+    atomic_int next;
+    int busy;
+    unsigned long generation;
+    bool stop;
+} ThreadPool;
+
+typedef enum {
+    LAYER_DENSE,
+    LAYER_GRU,
+    LAYER_CONV2D,
+    LAYER_MAXPOOL,
+    LAYER_AVGPOOL,
+} LayerType;
+
+// what a layer does with its weights when it is not a plain dense layer
+// a LAYER_GRU of n units keeps the gates fused, in the order update, reset, candidate:
+// weights is in x 3n, biases is 1 x 3n and recurrent is n x 3n, its activation is ignored
+// image layers see a row as height x width x channels (channels last), a LAYER_CONV2D has
+// weights kernel * kernel * channels x filters (rows ordered ky, kx, channel) and biases 1 x filters,
+// pooling layers have no parameters and ignore their activation
+typedef struct LAYER {
+    LayerType type;
+    int units;   // LAYER_DENSE, LAYER_GRU
+    int filters; // LAYER_CONV2D output channels
+    int kernel;  // square window of LAYER_CONV2D and the pooling layers
+    int stride;
+    int padding; // zeros around the input of a LAYER_CONV2D
+    // input and output shape of image layers, filled in by ShapedNetwork
+    int channels;
+    int height;
+    int width;
+    int outHeight;
+    int outWidth;
+    Matrix recurrent;
+} Layer;
+
+// workspace of one LAYER_GRU for one ForwardContext, empty matrices for the other layers
+typedef struct RECURRENT_STATE {
+    Matrix hidden;  // streams x n, carried from one forward call to the next
+    Matrix initial; // hidden as it was when the last forward call started, backprop starts from it
+    Matrix gates;   // batch x 4n, update, reset, candidate and the candidate's recurrent term of every row
+    Matrix recur;   // streams x 3n, hidden * recurrent for the step being computed
+} RecurrentState;
+
+// backprop counterpart of RecurrentState
+typedef struct RECURRENT_DELTAS {
+    Matrix gates; // batch x 6n, dLoss/d(in * weights + biases) then dLoss/d(hidden * recurrent)
+    Matrix carry; // streams x n, dLoss/d(hidden) flowing back from the next step
+    Matrix recur; // streams x n
+} RecurrentDeltas;
+
 typedef struct NETWORK {
     int count;
     Matrix *layers;
     Matrix *weights;
     Matrix *biases;
     Activation *activations;
+    GemmPlan *plans;                  // count * GEMM_PLAN_BATCHES, NULL until Network_autotune
+    Layer *specs;                     // NULL when every layer is dense
+    RecurrentState *recurrent;        // workspace of Network_forward_context, NULL without recurrent layers
+    RecurrentDeltas *recurrentDeltas; // workspace of Network_backward_context
+    float *columns;                   // im2col workspace of Network_forward_context, NULL without convolutions
+    float *columnDeltas;              // col2im workspace of Network_backward_context
 } Network;
 
+// per-call activation workspace, lets many threads run one Network at the same time
+// layers[i] is batch x (size of layer i)
+// recurrent layers see the rows as time major steps of `streams` independent sequences:
+// rows [t * streams, (t + 1) * streams) are step t of every stream
+typedef struct FORWARD_CONTEXT {
+    int count;
+    int batch;
+    int streams;
+    Matrix *layers;
+    RecurrentState *recurrent; // NULL without recurrent layers
+    float *columns;            // im2col of the convolution being computed, NULL without convolutions
+} ForwardContext;
+
+// backprop counterpart of ForwardContext
+// deltas[i] holds dLoss/d(layers[i]) for every row of the batch
+typedef struct BACKWARD_CONTEXT {
+    int count;
+    int batch;
+    Matrix *deltas;
+    RecurrentDeltas *recurrent; // NULL without recurrent layers
+    float *columns;             // dLoss/d(im2col) of the convolution being backpropagated
+} BackwardContext;
+
+// training workspace that keeps the activations of only every `interval` layers
+// the backward pass recomputes the layers in between one segment at a time, which costs about one
+// extra forward pass and needs count / interval + interval activations instead of count + 1
+typedef struct CHECKPOINT_CONTEXT {
+    int count;
+    int batch;
+    int interval;
+    int segments;
+    Matrix *saved;     // layers 0, interval, 2 * interval, ... and count, segments + 1 of them
+    Matrix delta;      // dLoss/dOutput, filled in before Network_backward_checkpointed
+    Matrix *layers;    // interval + 1 views over saved and layerWork for the segment being worked on
+    Matrix *deltas;    // interval + 1 views over deltaWork
+    float *layerWork;  // interval - 1 slots for the layers inside a segment
+    float *deltaWork;  // interval + 1 slots, the last two pass the delta from one segment to the one below
+    int widest;        // floats per row of every slot
+    float *columns;    // convolution workspaces, NULL without convolutions
+    float *columnDeltas;
+} CheckpointContext;
+
+// rows of mostly zero Network inputs in compressed sparse row form
+// the nonzeros of row i are indexes/values [offsets[i], offsets[i + 1])
+typedef struct SPARSE_INPUT {
+    int rows;
+    int cols;
+    int count;
+    int capacity;
+    int rowCapacity;
+    int *offsets;
+    int *indexes;
+    float *values; // NULL for binary inputs, every listed index is 1
+} SparseInput;
+
+// number of weight buffers a NetworkPublisher rotates through
+// one is published, one can be held by slow readers, one is free for the writer
+#define PUBLISHER_BUFFERS 3
+
+typedef struct NETWORK_PUBLISHER {
+    Network buffers[PUBLISHER_BUFFERS];
+    unsigned long versions[PUBLISHER_BUFFERS];
+    atomic_int readers[PUBLISHER_BUFFERS];
+    atomic_int current;
+    atomic_ulong version;
+    int interval;
+    int steps;
+} NetworkPublisher;
+
+// slot 0 of a SharedNetwork segment starts at a multiple of this, covers every page size and the
+// Windows allocation granularity
+#define SHARED_NETWORK_ALIGN 65536
+
+// start of a SharedNetwork segment, followed by the int arrays arch (count + 1), activations (count)
+// and, for layered networks, count layer descriptors; then come PUBLISHER_BUFFERS parameter slots
+typedef struct SHARED_NETWORK_HEADER {
+    char magic[4];
+    int count;
+    int layered;
+    int hasActivations;
+    size_t headerBytes; // where slot 0 starts
+    size_t slotBytes;
+    unsigned long generations[PUBLISHER_BUFFERS];
+    atomic_int readers[PUBLISHER_BUFFERS]; // pins of every attached process together
+    atomic_int current;
+    atomic_ulong generation; // 0 until the creator has written the first slot
+} SharedNetworkHeader;
+
+// a Network whose parameters live in a named shared memory segment, one copy for every process on
+// the machine. Slots rotate like the buffers of a NetworkPublisher, the creating process publishes
+// and everyone else attaches with the parameter pages mapped read-only
+typedef struct SHARED_NETWORK {
+    SharedNetworkHeader *header;
+    void *mapping;
+    size_t size;
+    bool owner;
+    Network views[PUBLISHER_BUFFERS]; // this process's Network over each slot, they own no parameters
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE map;
+#endif
+} SharedNetwork;
+
+// a Checkpointer writes every `fullEvery`th checkpoint in full and the others as deltas against the
+// last full one
+#define CHECKPOINT_FULL 0
+#define CHECKPOINT_DELTA 1
+
+// snapshot the training thread hands to the checkpoint writer
+typedef struct CHECKPOINT_SNAPSHOT {
+    float *params;
+    unsigned long sequence;
+} CheckpointSnapshot;
+
+// saves the parameters of a fixed set of Networks (a model and whatever optimizer state is kept
+// in Networks of its own) in the background. Checkpointer_save only copies the parameters into
+// a free snapshot, a writer thread encodes and writes it
+typedef struct CHECKPOINTER {
+    int count;
+    Network **networks;
+    size_t *sizes;     // floats of every network
+    size_t paramCount; // floats of all of them
+    int fullEvery;
+    char path[4096];
+    CheckpointSnapshot snapshots[2];
+    int writing; // snapshot the writer is busy with, -1 when idle
+    int pending; // snapshot waiting for the writer, -1 for none
+    int *layout; // count, then every network's Network_getArch preceded by its length
+    int layoutLen;
+    float *base; // parameters of the last full checkpoint, only touched by the writer
+    unsigned long baseSequence;
+    uint64_t baseHash; // payload hash of that full checkpoint, ties deltas to it
+    unsigned long sequence;
+    int sinceFull;
+    unsigned char *encoded;
+    unsigned long written;
+    unsigned long failed;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    bool stop;
+} Checkpointer;
+
+// power of two buckets, bucket i counts values in [2^i - 1, 2^(i + 1) - 1)
+#define HISTOGRAM_BUCKETS 32
+
+typedef struct HISTOGRAM {
+    atomic_ulong counts[HISTOGRAM_BUCKETS];
+} Histogram;
+
+// one pending call of InferenceServer_infer, lives on the caller's stack
+typedef struct INFERENCE_REQUEST {
+    float *input;
+    float *output;
+    double arrival;
+    double deadline;
+    bool done;
+    struct INFERENCE_REQUEST *next;
+} InferenceRequest;
+
+// open client socket of the InferenceServer unix front end
+typedef struct INFERENCE_CONNECTION {
+    struct INFERENCE_SERVER *server;
+    int fd;
+    struct INFERENCE_CONNECTION *next;
+} InferenceConnection;
+
+// collects concurrent single-row requests into batches for one Network_forward_ctx
+typedef struct INFERENCE_SERVER {
+    Network *nn;
+    NetworkPublisher *publisher; // if set, every batch runs on its latest snapshot instead of nn
+    SharedNetwork *shared;       // same for the latest generation of a shared memory model
+    int maxBatch;
+    double maxDelay; // seconds a request may wait for its batch to fill
+    ForwardContext ctx;
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t pending;
+    pthread_cond_t finished;
+    InferenceRequest *head;
+    InferenceRequest *tail;
+    int depth;
+    bool stop;
+    Histogram queueDepth; // requests waiting when a batch is taken
+    Histogram batchSize;
+    Histogram latency; // microseconds from submit to result
+    // unix socket front end
+    int listenFd;
+    bool listening;
+    pthread_t acceptThread;
+    InferenceConnection *connections;
+    pthread_cond_t closed;
+    char socketPath[108];
+} InferenceServer;
+
+// one read-only copy of a Network per NUMA node, so inference threads read local memory
+typedef struct NETWORK_REPLICAS {
+    int nodes;
+    Network *replicas;
+} NetworkReplicas;
+
+// many Networks of one architecture with all their parameters stacked in one buffer
+// member m owns params[m * paramCount .. (m + 1) * paramCount), laid out layer by layer
+// as weights (row major) followed by biases, offsets[l] is where layer l starts
+typedef struct POPULATION {
+    int size;
+    int count;
+    int *arch;
+    Activation *activations;
+    int *offsets;
+    int paramCount;
+    float *params;
+    float *spare; // second buffer Population_evolve builds the next generation in
+} Population;
+
+// rows of one member's states a Population_forward task multiplies, members with more states are
+// split over several tasks so a small population still fills the pool
+#define POPULATION_TASK_ROWS 64
+
+// in/out matrices read straight out of a read-only memory mapped file
+// any number of threads can train on one Dataset, writing to it crashes
+typedef struct DATASET {
+    Matrix in;
+    Matrix out;
+    void *mapping;
+    size_t size;
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE file;
+    HANDLE map;
+#endif
+} Dataset;
+
+#define SWEEP_MAX_LAYERS 8
+
+// what Sweep_grid / Sweep_random pick architectures and learning rates from
+typedef struct SWEEP_SPACE {
+    int inputs;
+    int outputs;
+    int minLayers; // hidden layers
+    int maxLayers;
+    int *sizes; // candidate hidden layer widths
+    int sizeCount;
+    ActivationType *activations; // candidate hidden activations
+    int activationCount;
+    ActivationType outputActivation;
+    float *rates; // grid learning rates
+    int rateCount;
+    float minRate; // random search samples log uniformly between these
+    float maxRate;
+} SweepSpace;
+
+typedef struct SWEEP_TRIAL {
+    int id;
+    int arch[SWEEP_MAX_LAYERS + 2];
+    int archLen;
+    ActivationType activations[SWEEP_MAX_LAYERS + 1];
+    float rate;
+    int epochs;
+    float loss;
+    bool stopped;
+    Network nn;
+    Network g;
+    ForwardContext fctx;
+    BackwardContext bctx;
+} SweepTrial;
+
+typedef struct SWEEP_CONFIG {
+    int threads; // trials trained at the same time
+    int batch;
+    int minEpochs; // budget of the first rung
+    int maxEpochs;
+    int eta; // successive halving keeps 1 / eta of the trials per rung
+    uint64_t seed;
+    bool verbose;
+} SweepConfig;
+
 #define ARR_LEN(arr) (sizeof(arr) / sizeof(*(arr)))
 
 #define MAT_AT(M, i, j) ((M)->data[((i) * (M)->stride) + (j)])
@@ -57,8 +508,26 @@ typedef struct NETWORK {
 #define NETWORK_IN(nn) ((nn)->layers[0])
 #define NETWORK_OUT(nn) ((nn)->layers[(nn)->count])
 
+#define CONTEXT_IN(ctx) ((ctx)->layers[0])
+#define CONTEXT_OUT(ctx) ((ctx)->layers[(ctx)->count])
+#define CHECKPOINT_IN(ctx) ((ctx)->saved[0])
+#define CHECKPOINT_OUT(ctx) ((ctx)->saved[(ctx)->segments])
+
 #define SOFTMAX_OUTPUTS(nn) (softmaxf(NETWORK_OUT(nn)))
 
+Rng Rng_new(uint64_t seed, int stream);
+void Rng_jump(Rng *rng);
+uint32_t Rng_u32(Rng *rng);
+float Rng_float(Rng *rng);
+int Rng_int(Rng *rng, int low, int high);
+float Rng_normal(Rng *rng);
+void Rng_fill_uniform(Rng *rng, float *dest, int n, float low, float high);
+void Rng_fill_normal(Rng *rng, float *dest, int n, float mean, float std);
+void Rng_fill_int(Rng *rng, int *dest, int n, int low, int high);
+int Rng_categorical(Rng *rng, Matrix *probs);
+int Rng_epsilon_greedy(Rng *rng, Matrix *q, float epsilon);
+Rng *rng_thread(void);
+void rng_seed(uint64_t seed);
 float rand_float();
 float sigmoidf(float x);
 float reluf(float x);
@@ -99,8 +568,8 @@ float tanhDerivative(float x) {
 }
 
 void softmaxf(Matrix *m) {
-    float sum = 0.f;
     for (int i = 0; i < m->rows; i++) {
+        float sum = 0.f;
         for (int j = 0; j < m->cols; j++) {
             MAT_AT(m, i, j) = expf(MAT_AT(m, i, j));
             sum += MAT_AT(m, i, j);
@@ -158,28 +627,284 @@ float (*getActDerivative(ActivationType a))(float) {
     }
 }
 
+// seed used by the per thread generators until rng_seed is called
+#define RNG_DEFAULT_SEED 0x853c49e6748fea9bULL
+
+// streams handed out to threads that use rand_float/rand_int/matrix_rand without their own Rng
+atomic_int rngThreadStreams = 0;
+// process wide seed of those streams, every rng_seed bumps the generation so each thread reseeds on its next draw
+_Atomic uint64_t rngBaseSeed = RNG_DEFAULT_SEED;
+atomic_uint rngSeedGeneration = 0;
+_Thread_local Rng rngThreadState;
+_Thread_local int rngThreadStream = -1;
+_Thread_local unsigned rngThreadGeneration = 0;
+_Thread_local bool rngThreadSeeded = false;
+
+uint32_t rng_rotl(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+uint64_t rng_splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// steps every lane once, out gets one xoshiro128** output per lane
+void rng_next_lanes(Rng *rng, uint32_t *out) {
+    uint32_t *s0 = rng->s[0], *s1 = rng->s[1], *s2 = rng->s[2], *s3 = rng->s[3];
+    for (int l = 0; l < RNG_LANES; l++) {
+        out[l] = rng_rotl(s1[l] * 5, 7) * 9;
+        uint32_t t = s1[l] << 9;
+        s2[l] ^= s0[l];
+        s3[l] ^= s1[l];
+        s1[l] ^= s2[l];
+        s0[l] ^= s3[l];
+        s2[l] ^= t;
+        s3[l] = rng_rotl(s3[l], 11);
+    }
+}
+
+// advances one lane by 2^64 draws
+void rng_jump_lane(Rng *rng, int lane) {
+    static const uint32_t jump[] = {0x8764000b, 0xf542d2d3, 0x6fa035c3, 0x77f2db5b};
+    uint32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 32; b++) {
+            if (jump[i] & (1u << b)) {
+                s0 ^= rng->s[0][lane];
+                s1 ^= rng->s[1][lane];
+                s2 ^= rng->s[2][lane];
+                s3 ^= rng->s[3][lane];
+            }
+            uint32_t t = rng->s[1][lane] << 9;
+            rng->s[2][lane] ^= rng->s[0][lane];
+            rng->s[3][lane] ^= rng->s[1][lane];
+            rng->s[1][lane] ^= rng->s[2][lane];
+            rng->s[0][lane] ^= rng->s[3][lane];
+            rng->s[2][lane] ^= t;
+            rng->s[3][lane] = rng_rotl(rng->s[3][lane], 11);
+        }
+    }
+    rng->s[0][lane] = s0;
+    rng->s[1][lane] = s1;
+    rng->s[2][lane] = s2;
+    rng->s[3][lane] = s3;
+}
+
+// every lane of every stream is its own non overlapping 2^64 long block of one sequence,
+// so Rngs made from the same seed with different streams never repeat each other
+Rng Rng_new(uint64_t seed, int stream) {
+    Rng rng = {0};
+    uint64_t x = seed;
+    for (int i = 0; i < 2; i++) {
+        uint64_t z = rng_splitmix64(&x);
+        rng.s[i * 2][0] = (uint32_t) z;
+        rng.s[i * 2 + 1][0] = (uint32_t) (z >> 32);
+    }
+    for (int i = 0; i < stream * RNG_LANES; i++) {
+        rng_jump_lane(&rng, 0);
+    }
+    for (int l = 1; l < RNG_LANES; l++) {
+        for (int i = 0; i < 4; i++) {
+            rng.s[i][l] = rng.s[i][l - 1];
+        }
+        rng_jump_lane(&rng, l);
+    }
+    rng.index = RNG_LANES;
+    return rng;
+}
+
+// moves the whole generator to the block of the next stream
+void Rng_jump(Rng *rng) {
+    for (int l = 0; l < RNG_LANES; l++) {
+        for (int i = 0; i < RNG_LANES; i++) {
+            rng_jump_lane(rng, l);
+        }
+    }
+    rng->index = RNG_LANES;
+}
+
+uint32_t Rng_u32(Rng *rng) {
+    if (rng->index >= RNG_LANES) {
+        rng_next_lanes(rng, rng->buffer);
+        rng->index = 0;
+    }
+    return rng->buffer[rng->index++];
+}
+
+// random float from 0 to 1 (excluding 1)
+float Rng_float(Rng *rng) {
+    return (Rng_u32(rng) >> 8) * (1.f / 16777216.f);
+}
+
+// low <= n <= high without the modulo bias of rand() % n, the bounds are swapped if low > high
+int Rng_int(Rng *rng, int low, int high) {
+    if (low > high) {
+        int t = low;
+        low = high;
+        high = t;
+    }
+    uint32_t range = (uint32_t) high - (uint32_t) low + 1;
+    if (range == 0)
+        return (int) Rng_u32(rng);
+    uint64_t m = (uint64_t) Rng_u32(rng) * range;
+    if ((uint32_t) m < range) {
+        uint32_t threshold = -range % range;
+        while ((uint32_t) m < threshold) {
+            m = (uint64_t) Rng_u32(rng) * range;
+        }
+    }
+    return (int) ((uint32_t) low + (uint32_t) (m >> 32));
+}
+
+// standard normal sample (Box-Muller)
+float Rng_normal(Rng *rng) {
+    float u1 = ((Rng_u32(rng) >> 8) + 1) * (1.f / 16777216.f);
+    float u2 = (Rng_u32(rng) >> 8) * (1.f / 16777216.f);
+    return sqrtf(-2.f * logf(u1)) * cosf(6.2831853f * u2);
+}
+
+void Rng_fill_uniform(Rng *rng, float *dest, int n, float low, float high) {
+    float scale = (high - low) * (1.f / 16777216.f);
+    uint32_t r[RNG_LANES];
+    int i = 0;
+    for (; i + RNG_LANES <= n; i += RNG_LANES) {
+        rng_next_lanes(rng, r);
+        for (int l = 0; l < RNG_LANES; l++) {
+            dest[i + l] = (r[l] >> 8) * scale + low;
+        }
+    }
+    for (; i < n; i++) {
+        dest[i] = (Rng_u32(rng) >> 8) * scale + low;
+    }
+}
+
+// Box-Muller on whole lanes, every pair of uniforms gives two normals
+void Rng_fill_normal(Rng *rng, float *dest, int n, float mean, float std) {
+    uint32_t a[RNG_LANES], b[RNG_LANES];
+    float radius[RNG_LANES], angle[RNG_LANES];
+    int i = 0;
+    for (; i + 2 * RNG_LANES <= n; i += 2 * RNG_LANES) {
+        rng_next_lanes(rng, a);
+        rng_next_lanes(rng, b);
+        for (int l = 0; l < RNG_LANES; l++) {
+            float u1 = ((a[l] >> 8) + 1) * (1.f / 16777216.f);
+            radius[l] = std * sqrtf(-2.f * logf(u1));
+            angle[l] = 6.2831853f * (b[l] >> 8) * (1.f / 16777216.f);
+        }
+        for (int l = 0; l < RNG_LANES; l++) {
+            dest[i + l] = mean + radius[l] * cosf(angle[l]);
+            dest[i + RNG_LANES + l] = mean + radius[l] * sinf(angle[l]);
+        }
+    }
+    for (; i < n; i++) {
+        dest[i] = mean + std * Rng_normal(rng);
+    }
+}
+
+void Rng_fill_int(Rng *rng, int *dest, int n, int low, int high) {
+    for (int i = 0; i < n; i++) {
+        dest[i] = Rng_int(rng, low, high);
+    }
+}
+
+// samples an index of the first row of probs, weighted by its (not necessarily normalized) values
+int Rng_categorical(Rng *rng, Matrix *probs) {
+    float sum = 0.f;
+    for (int j = 0; j < probs->cols; j++) {
+        sum += MAT_AT(probs, 0, j);
+    }
+    float target = Rng_float(rng) * sum;
+    for (int j = 0; j < probs->cols; j++) {
+        target -= MAT_AT(probs, 0, j);
+        if (target < 0.f)
+            return j;
+    }
+    return probs->cols - 1;
+}
+
+// random action with chance epsilon, otherwise the action with the highest Q value in the first row of q
+int Rng_epsilon_greedy(Rng *rng, Matrix *q, float epsilon) {
+    if (Rng_float(rng) < epsilon)
+        return Rng_int(rng, 0, q->cols - 1);
+
+    int best = 0;
+    for (int j = 1; j < q->cols; j++) {
+        if (MAT_AT(q, 0, j) > MAT_AT(q, 0, best))
+            best = j;
+    }
+    return best;
+}
+
+// generator of the calling thread, every thread gets its own stream of the process wide seed on first use
+Rng *rng_thread(void) {
+    unsigned generation = atomic_load(&rngSeedGeneration);
+    if (!rngThreadSeeded || rngThreadGeneration != generation) {
+        if (rngThreadStream < 0)
+            rngThreadStream = atomic_fetch_add(&rngThreadStreams, 1);
+        rngThreadState = Rng_new(atomic_load(&rngBaseSeed), rngThreadStream);
+        rngThreadGeneration = generation;
+        rngThreadSeeded = true;
+    }
+    return &rngThreadState;
+}
+
+// reseeds the generators of every thread, replaces srand
+// each thread keeps its stream, so it restarts at the same block of the new seed's sequence
+void rng_seed(uint64_t seed) {
+    atomic_store(&rngBaseSeed, seed);
+    atomic_fetch_add(&rngSeedGeneration, 1);
+}
+
 // random float from 0 to 1
 float rand_float() {
-    return ((float) rand() / (float) RAND_MAX);
+    return Rng_float(rng_thread());
 }
 
 // random number from low to high including high
 // low <= n <= high
 int rand_int(int low, int high) {
-    return (rand() % (high - low + 1)) + low;
+    return Rng_int(rng_thread(), low, high);
 }
 
 void step_copy(Step *dest, Step *src);
 
+AllocPolicy ml_default_alloc_policy(void);
+AllocPolicy ml_set_alloc_policy(AllocPolicy policy);
+void *ml_calloc(size_t count, size_t size);
+int ml_numa_nodes(void);
+int ml_current_node(void);
+
 Matrix matrix_new(int rows, int cols);
 void matrix_free(Matrix *m);
 
+int ml_cpu_count(void);
+double ml_time(void);
+ThreadPool *ThreadPool_new(int threads);
+void ThreadPool_free(ThreadPool *pool);
+void ThreadPool_run(ThreadPool *pool, int tasks, void (*task)(void *arg, int index), void *arg);
+ThreadPool *ThreadPool_default(void);
+
 void matrix_dot(Matrix *dest, Matrix *a, Matrix *b);
+void matrix_dot_plan(Matrix *dest, Matrix *a, Matrix *b, GemmPlan *plan);
+GemmPlan gemm_default_plan(void);
+GemmPlan gemm_tune(int rows, int inner, int cols);
+void matrix_dot_at(Matrix *dest, Matrix *a, Matrix *b);
+void matrix_dot_bt(Matrix *dest, Matrix *a, Matrix *b);
 void matrix_sum(Matrix *dest, Matrix *src);
+void matrix_add_row(Matrix *dest, Matrix *row);
 void matrix_activate(Matrix *m, float (*actFunc)(float));
+void matrix_apply_activation(Matrix *m, Activation *a);
 void matrix_rand(Matrix *m, float low, float high);
+void matrix_rand_rng(Matrix *m, Rng *rng, float low, float high);
+void matrix_randn_rng(Matrix *m, Rng *rng, float mean, float std);
 Matrix matrix_row(Matrix *src, int row);
 Matrix matrix_col(Matrix *src, int col);
+Matrix matrix_rows(Matrix *src, int row, int count);
+Matrix matrix_cols(Matrix *src, int col, int count);
+Matrix matrix_reshape(Matrix *src, int rows, int cols);
 void matrix_copy(Matrix *dest, Matrix *src);
 void matrix_clear(Matrix *m);
 void matrix_print(Matrix *m, const char *name, int padding, const char *format);
@@ -187,40 +912,182 @@ void print_activation(Activation *a, const char *name, int padding);
 bool matrix_same(Matrix *a, Matrix *b);
 bool matrix_equal(Matrix *a, Matrix *b);
 void fwrite_matrix(Matrix *m, FILE *dest);
-void fread_matrix(Matrix *m, FILE *src);
+bool fread_matrix(Matrix *m, FILE *src);
 void matrix_shuffle_rows(Matrix *m);
+void matrix_shuffle_rows_rng(Matrix *m, Rng *rng);
 
 void xavier_init(Matrix *m);
+void xavier_init_rng(Matrix *m, Rng *rng);
+void he_init_rng(Matrix *m, Rng *rng);
 
 #define GradientNetwork(layers, count) NeuralNetwork((layers), (count), NULL)
+#define LayeredGradientNetwork(layers, count, types) LayeredNetwork((layers), (count), NULL, (types))
+#define ShapedGradientNetwork(channels, height, width, layers, count) \
+    ShapedNetwork((channels), (height), (width), (layers), (count), NULL)
 
 Network NeuralNetwork(int *layers, int count, ActivationType *activations);
+Network LayeredNetwork(int *layers, int count, ActivationType *activations, LayerType *types);
+Network ShapedNetwork(int channels, int height, int width, Layer *layers, int count, ActivationType *activations);
+Layer Layer_dense(int units);
+Layer Layer_gru(int units);
+Layer Layer_conv2d(int filters, int kernel, int stride, int padding);
+Layer Layer_maxpool(int size);
+Layer Layer_avgpool(int size);
+LayerType Network_layer_type(Network *nn, int layer);
+bool Network_is_recurrent(Network *nn);
 void Network_print(Network *nn, const char *name, bool showLayers);
 void Network_rand(Network *nn, float low, float high);
 float Network_cost(Network *nn, Matrix *in, Matrix *out);
 float Network_Q_cost(Network *nn, Step *steps, int stepAmount, Matrix *Qtargets);
 float Network_cross_entropy_loss(Network *nn, Step *steps, int stepAmount);
+float Network_cross_entropy_loss_weighted(Network *nn, Step *steps, float *weights, int stepAmount);
 void Network_forward(Network *nn);
 void Network_diff(Network *nn, Network *g, float eps, Matrix *in, Matrix *out);
 void Network_policy_gradient_diff(Network *nn, Network *g, float eps, Step *steps, int stepAmount);
 void Network_backprop(Network *nn, Network *g, Matrix *in, Matrix *out);
 void Network_Q_backprop(Network *nn, Network *g, Matrix *Qtargets, Step *steps, int *stepIndexes);
 void Network_policy_gradient_backprop(Network *nn, Network *g, Step *steps, int stepAmount);
+void Network_policy_gradient_backprop_weighted(Network *nn, Network *g, Step *steps, float *weights, int stepAmount);
 void Network_clear(Network *nn);
 void Network_gradient_descent(Network *nn, Network *g, float rate);
 void Network_gradient_ascent(Network *nn, Network *g, float rate);
 void Network_copy(Network *dest, Network *src);
 bool Network_same(Network *a, Network *b);
 void Network_save(Network *nn, const char *fileName);
-void Network_load(Network *nn, const char *fileName);
+bool Network_load(Network *nn, const char *fileName);
 int *Network_getArch(Network *nn);
 bool Network_cmpArch(Network *nn, int *arch, int archLen);
 void calc_QTargets(Network *TargetNN, Matrix *QTargets, Step *steps, int *indexes);
+void Network_scale(Network *nn, float factor);
+GemmPlan *Network_plan(Network *nn, int layer, int batch);
+void Network_autotune(Network *nn, int *batches, int batchCount, const char *cachePath);
+
+ForwardContext ForwardContext_new(Network *nn, int batch);
+ForwardContext ForwardContext_sequence(Network *nn, int streams, int steps);
+void ForwardContext_free(ForwardContext *ctx);
+void ForwardContext_set_rows(ForwardContext *ctx, int rows);
+void ForwardContext_reset(ForwardContext *ctx);
+void ForwardContext_reset_stream(ForwardContext *ctx, int stream);
+ForwardContext Network_forward_context(Network *nn);
+BackwardContext BackwardContext_new(Network *nn, int batch);
+BackwardContext BackwardContext_sequence(Network *nn, int streams, int steps);
+void BackwardContext_free(BackwardContext *ctx);
+void BackwardContext_set_rows(BackwardContext *ctx, int rows);
+BackwardContext Network_backward_context(Network *g);
+void Network_forward_ctx(Network *nn, ForwardContext *ctx);
+bool Network_lanes_fit(Network *nn);
+void Network_forward_lanes(Network *nn, Matrix *in, Matrix *out);
+void Network_forward_soa(Network *nn, Matrix *in, Matrix *out);
+void Network_backward_ctx(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx);
+bool CheckpointContext_new(CheckpointContext *out, Network *nn, int batch, int interval);
+void CheckpointContext_free(CheckpointContext *ctx);
+void CheckpointContext_set_rows(CheckpointContext *ctx, int rows);
+void Network_forward_checkpointed(Network *nn, CheckpointContext *ctx);
+void Network_backward_checkpointed(Network *nn, Network *g, CheckpointContext *ctx);
+void Network_backprop_checkpointed(Network *nn, Network *g, CheckpointContext *ctx, Matrix *in, Matrix *out);
+
+SparseInput SparseInput_new(int cols, bool binary);
+void SparseInput_free(SparseInput *sp);
+void SparseInput_clear(SparseInput *sp);
+void SparseInput_add(SparseInput *sp, int *indexes, float *values, int n);
+void SparseInput_add_dense(SparseInput *sp, Matrix *row);
+void SparseInput_add_bits(SparseInput *sp, uint64_t *bits);
+void SparseInput_gather(SparseInput *dest, SparseInput *src, int *rows, int n);
+void SparseInput_to_dense(SparseInput *sp, int row, Matrix *dest);
+void Network_forward_sparse(Network *nn, ForwardContext *ctx, SparseInput *in);
+void Network_backward_sparse(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx, SparseInput *in);
+void Network_backprop_sparse(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx, SparseInput *in, Matrix *out);
+void Network_gradient_descent_sparse(Network *nn, Network *g, float rate, SparseInput *in);
+float Network_cost_ctx(Network *nn, ForwardContext *ctx, Matrix *in, Matrix *out);
+float Network_Q_cost_ctx(Network *nn, ForwardContext *ctx, Step *steps, int stepAmount, Matrix *Qtargets);
+void Network_backprop_ctx(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx, Matrix *in, Matrix *out);
+void Network_Q_backprop_ctx(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx, Matrix *Qtargets, Step *steps, int *stepIndexes);
+void Network_policy_gradient_backprop_ctx(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx, Step *steps, int stepAmount);
+void Network_policy_gradient_backprop_weighted_ctx(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx, Step *steps, float *weights, int stepAmount);
+void calc_QTargets_ctx(Network *TargetNN, ForwardContext *ctx, Matrix *QTargets, Step *steps, int *indexes);
+
+Trajectory Trajectory_new(int steps, int streams);
+void Trajectory_free(Trajectory *tr);
+void Trajectory_set_steps(Trajectory *tr, Step *steps);
+void Trajectory_returns(Trajectory *tr, float gamma);
+void Trajectory_nstep(Trajectory *tr, float gamma, int n);
+void Trajectory_gae(Trajectory *tr, float gamma, float lambda);
+void Trajectory_normalize(float *x, int n);
 
 void Network_xavier_init(Network *nn);
+void Network_xavier_init_rng(Network *nn, Rng *rng);
+void Network_he_init_rng(Network *nn, Rng *rng);
+Network Network_clone(Network *src);
+void Network_free(Network *nn);
+
+Population Population_new(Network *nn, int size);
+void Population_free(Population *pop);
+void Population_weights(Population *pop, int member, int layer, Matrix *weights, Matrix *biases);
+void Population_get(Population *pop, int member, Network *dest);
+void Population_set(Population *pop, int member, Network *src);
+ForwardContext Population_context(Population *pop, int statesPerMember);
+bool Population_forward(Population *pop, ForwardContext *ctx);
+void Population_mutate(Population *pop, Rng *rng, float rate, float sigma);
+void Population_crossover(Population *pop, int dest, int a, int b, Rng *rng);
+void Population_evolve(Population *pop, float *fitness, int elites, int tournament, float rate, float sigma, Rng *rng);
+void Population_es_sample(Population *pop, Network *center, float sigma, Rng *rng);
+void Population_es_gradient(Population *pop, Network *center, float *fitness, float sigma, Network *grad);
+
+bool Dataset_save(const char *path, Matrix *in, Matrix *out);
+bool Dataset_map(Dataset *ds, const char *path);
+void Dataset_unmap(Dataset *ds);
+
+SweepTrial *Sweep_grid(SweepSpace *space, int *count);
+SweepTrial *Sweep_random(SweepSpace *space, int count, Rng *rng);
+void Sweep_run(SweepTrial *trials, int count, Dataset *train, Dataset *valid, SweepConfig *config);
+void Sweep_free(SweepTrial *trials, int count);
+bool Sweep_write_csv(SweepTrial *trials, int count, const char *path);
+bool Sweep_write_json(SweepTrial *trials, int count, const char *path);
+
+void Histogram_add(Histogram *h, unsigned long value);
+unsigned long Histogram_count(Histogram *h);
+unsigned long Histogram_percentile(Histogram *h, float p);
+void Histogram_print(Histogram *h, const char *name);
+
+InferenceServer *InferenceServer_new(Network *nn, NetworkPublisher *publisher, int maxBatch, double maxDelay);
+InferenceServer *InferenceServer_new_shared(SharedNetwork *shared, int maxBatch, double maxDelay);
+void InferenceServer_free(InferenceServer *server);
+bool InferenceServer_infer(InferenceServer *server, float *input, float *output, double maxDelay);
+bool InferenceServer_listen(InferenceServer *server, const char *path);
+void InferenceServer_print_stats(InferenceServer *server);
+
+NetworkReplicas NetworkReplicas_new(Network *nn);
+void NetworkReplicas_free(NetworkReplicas *rep);
+void NetworkReplicas_sync(NetworkReplicas *rep, Network *nn);
+Network *NetworkReplicas_local(NetworkReplicas *rep);
+
+NetworkPublisher NetworkPublisher_new(Network *nn, int interval);
+void NetworkPublisher_free(NetworkPublisher *pub);
+bool NetworkPublisher_publish(NetworkPublisher *pub, Network *nn);
+bool NetworkPublisher_step(NetworkPublisher *pub, Network *nn);
+Network *NetworkPublisher_acquire(NetworkPublisher *pub, unsigned long *version);
+void NetworkPublisher_release(NetworkPublisher *pub, Network *snapshot);
+unsigned long NetworkPublisher_read(NetworkPublisher *pub, Network *dest, unsigned long seen);
+
+bool SharedNetwork_create(SharedNetwork *shared, const char *name, Network *nn);
+bool SharedNetwork_attach(SharedNetwork *shared, const char *name);
+void SharedNetwork_close(SharedNetwork *shared);
+bool SharedNetwork_unlink(const char *name);
+bool SharedNetwork_publish(SharedNetwork *shared, Network *nn);
+bool SharedNetwork_publish_file(SharedNetwork *shared, const char *fileName);
+unsigned long SharedNetwork_generation(SharedNetwork *shared);
+Network *SharedNetwork_acquire(SharedNetwork *shared, unsigned long *generation);
+void SharedNetwork_release(SharedNetwork *shared, Network *snapshot);
+
+Checkpointer *Checkpointer_new(Network **networks, int count, const char *path, int fullEvery);
+void Checkpointer_free(Checkpointer *cp);
+void Checkpointer_save(Checkpointer *cp);
+void Checkpointer_flush(Checkpointer *cp);
+bool Checkpointer_restore(Checkpointer *cp);
 
 const char fileExtension[] = ".netw";
 const char fileHeader[] = "nn";
+const char fileHeaderLayered[] = "nl";
 const char fileMatRow = '\n';
 
 void step_copy(Step *dest, Step *src) {
@@ -232,8 +1099,12 @@ void step_copy(Step *dest, Step *src) {
 }
 
 void matrix_shuffle_rows(Matrix *m) {
+    matrix_shuffle_rows_rng(m, rng_thread());
+}
+
+void matrix_shuffle_rows_rng(Matrix *m, Rng *rng) {
     for (int i = 0; i < m->rows; i++) {
-        int j = (i + rand() % (m->rows - i));
+        int j = Rng_int(rng, i, m->rows - 1);
         if (i == j)
             continue;
         for (int k = 0; k < m->cols; k++) {
@@ -245,17 +1116,25 @@ void matrix_shuffle_rows(Matrix *m) {
 }
 
 void xavier_init(Matrix *m) {
+    xavier_init_rng(m, rng_thread());
+}
+
+void xavier_init_rng(Matrix *m, Rng *rng) {
     float limit = sqrtf(6.f / (m->rows + m->cols));
-    matrix_rand(m, -limit, limit);
+    matrix_rand_rng(m, rng, -limit, limit);
+}
+
+// normal init for ReLU layers, std = sqrt(2 / fan in)
+void he_init_rng(Matrix *m, Rng *rng) {
+    matrix_randn_rng(m, rng, 0.f, sqrtf(2.f / m->rows));
 }
 
 int *Network_getArch(Network *nn) {
     int *arch = (int *) malloc(sizeof(*arch) * (nn->count + 1));
     for (int i = 0; i < nn->count; i++) {
-        // arch[i] = nn->weights[i]->rows;
-        arch[i] = nn->weights[i].rows;
+        arch[i] = nn->layers[i].cols;
     }
-    arch[nn->count] = NETWORK_OUT(nn).rows;
+    arch[nn->count] = NETWORK_OUT(nn).cols;
     return arch;
 }
 
@@ -264,19 +1143,81 @@ bool Network_cmpArch(Network *nn, int *arch, int archLen) {
         return false;
 
     for (int i = 0; i < nn->count; i++) {
-        if (arch[i] != nn->weights[i].rows)
+        if (arch[i] != nn->layers[i].cols)
             return false;
     }
-    if (arch[nn->count] != NETWORK_OUT(nn).rows)
+    if (arch[nn->count] != NETWORK_OUT(nn).cols)
         return false;
     return true;
 }
 
 void Network_xavier_init(Network *nn) {
+    Network_xavier_init_rng(nn, rng_thread());
+}
+
+void Network_xavier_init_rng(Network *nn, Rng *rng) {
+    for (int i = 0; i < nn->count; i++) {
+        xavier_init_rng(&nn->weights[i], rng);
+        xavier_init_rng(&nn->biases[i], rng);
+        if (Network_layer_type(nn, i) == LAYER_GRU)
+            xavier_init_rng(&nn->specs[i].recurrent, rng);
+    }
+}
+
+// biases start at zero
+void Network_he_init_rng(Network *nn, Rng *rng) {
     for (int i = 0; i < nn->count; i++) {
-        xavier_init(&nn->weights[i]);
-        xavier_init(&nn->biases[i]);
+        he_init_rng(&nn->weights[i], rng);
+        matrix_clear(&nn->biases[i]);
+        if (Network_layer_type(nn, i) == LAYER_GRU)
+            he_init_rng(&nn->specs[i].recurrent, rng);
+    }
+}
+
+#define LAYER_DESCRIPTOR_INTS 8
+
+// what a .netw file stores about each layer of a Network with specs
+void layer_descriptor(Layer *spec, int *descriptor) {
+    descriptor[0] = spec->type;
+    descriptor[1] = spec->filters;
+    descriptor[2] = spec->kernel;
+    descriptor[3] = spec->stride;
+    descriptor[4] = spec->padding;
+    descriptor[5] = spec->channels;
+    descriptor[6] = spec->height;
+    descriptor[7] = spec->width;
+}
+
+// inverse of layer_descriptor for a layer of `units` outputs, fills in the output shape
+// returns false if the descriptor can not describe a layer from `inputs` to `units` values
+bool layer_from_descriptor(Layer *spec, int *descriptor, int inputs, int units) {
+    memset(spec, 0, sizeof(*spec));
+    spec->type = descriptor[0];
+    spec->filters = descriptor[1];
+    spec->kernel = descriptor[2];
+    spec->stride = descriptor[3];
+    spec->padding = descriptor[4];
+    spec->channels = descriptor[5];
+    spec->height = descriptor[6];
+    spec->width = descriptor[7];
+    spec->units = units;
+    switch (spec->type) {
+        case LAYER_DENSE:
+        case LAYER_GRU:
+            return true;
+        case LAYER_CONV2D:
+        case LAYER_MAXPOOL:
+        case LAYER_AVGPOOL:
+            break;
+        default:
+            return false;
     }
+    if (spec->kernel <= 0 || spec->stride <= 0 || spec->padding < 0 || spec->channels * spec->height * spec->width != inputs)
+        return false;
+    spec->outHeight = (spec->height + 2 * spec->padding - spec->kernel) / spec->stride + 1;
+    spec->outWidth = (spec->width + 2 * spec->padding - spec->kernel) / spec->stride + 1;
+    int channels = (spec->type == LAYER_CONV2D ? spec->filters : spec->channels);
+    return spec->outHeight > 0 && spec->outWidth > 0 && channels * spec->outHeight * spec->outWidth == units;
 }
 
 void Network_save(Network *nn, const char *fileName) {
@@ -296,8 +1237,14 @@ void Network_save(Network *nn, const char *fileName) {
     strcat(path, fileName);
     strcat(path, fileExtension);
 
+#else
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%s", fileName, fileExtension);
+#endif
+
     FILE *networkFile = fopen(path, "r");
     if (networkFile) {
+        fclose(networkFile);
         fprintf(stderr, "File already exists\n");
         return;
     }
@@ -306,29 +1253,46 @@ void Network_save(Network *nn, const char *fileName) {
         fprintf(stderr, "File could not be opened\n");
         return;
     }
-#endif
 
     // Writing the file
-    fwrite(fileHeader, sizeof(char), sizeof(fileHeader) - 1, networkFile);
+    // networks with non dense layers get their own header and a descriptor per layer
+    if (nn->specs) {
+        fwrite(fileHeaderLayered, sizeof(char), sizeof(fileHeaderLayered) - 1, networkFile);
+    } else {
+        fwrite(fileHeader, sizeof(char), sizeof(fileHeader) - 1, networkFile);
+    }
     int *arch = Network_getArch(nn);
     int archLen = nn->count + 1;
     fwrite(&archLen, sizeof(archLen), 1, networkFile);
     fwrite(arch, sizeof(*arch), nn->count + 1, networkFile);
+    free(arch);
+    if (nn->specs) {
+        for (int i = 0; i < nn->count; i++) {
+            int descriptor[LAYER_DESCRIPTOR_INTS];
+            layer_descriptor(&nn->specs[i], descriptor);
+            fwrite(descriptor, sizeof(*descriptor), LAYER_DESCRIPTOR_INTS, networkFile);
+        }
+    }
     for (int i = 0; i < nn->count; i++) {
         fwrite_matrix(&nn->weights[i], networkFile);
         fwrite_matrix(&nn->biases[i], networkFile);
+        if (Network_layer_type(nn, i) == LAYER_GRU)
+            fwrite_matrix(&nn->specs[i].recurrent, networkFile);
     }
     fclose(networkFile);
     printf("File saved successfully\n");
 }
 
-void Network_load(Network *nn, const char *fileName) {
+// returns false, leaving nn untouched, if the file is missing or holds another architecture
+// a file that ends early also returns false, but the layers before the cut are already loaded
+// errors go to stderr and success is silent, SharedNetwork_publish_file calls this on every reload
+bool Network_load(Network *nn, const char *fileName) {
 #if defined(_WIN32) || defined(_WIN64)
     char path[MAX_PATH];
     int length = GetModuleFileNameA(NULL, path, sizeof(path));
     if (!length) {
         fprintf(stderr, "Failed to get file path\n");
-        return;
+        return false;
     }
     for (int i = length - 1; i >= 0; i--) {
         if (path[i - 1] == '\\') {
@@ -339,38 +1303,77 @@ void Network_load(Network *nn, const char *fileName) {
     strcat(path, fileName);
     strcat(path, fileExtension);
 
+#else
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%s", fileName, fileExtension);
+#endif
+
     FILE *networkFile = fopen(path, "rb");
     if (!networkFile) {
         fprintf(stderr, "File could not be opened\n");
-        return;
+        return false;
     }
-#endif
 
     // Reading the file
     unsigned long headerLen = sizeof(fileHeader) - 1;
     char header[sizeof(fileHeader) - 1];
-    fread(header, sizeof(*fileHeader), headerLen, networkFile);
-    if (strncmp(header, fileHeader, headerLen) != 0) {
+    if (fread(header, sizeof(*fileHeader), headerLen, networkFile) != headerLen) {
         fprintf(stderr, "Invalid %s file\n", fileExtension);
         fclose(networkFile);
-        return;
+        return false;
+    }
+    bool layered = (strncmp(header, fileHeaderLayered, headerLen) == 0);
+    if (!layered && strncmp(header, fileHeader, headerLen) != 0) {
+        fprintf(stderr, "Invalid %s file\n", fileExtension);
+        fclose(networkFile);
+        return false;
+    }
+    int archLen = 0;
+    if (fread(&archLen, sizeof(archLen), 1, networkFile) != 1 || archLen <= 0 || archLen > 1 << 16) {
+        fprintf(stderr, "Invalid %s file\n", fileExtension);
+        fclose(networkFile);
+        return false;
     }
-    int archLen;
-    fread(&archLen, sizeof(archLen), 1, networkFile);
     int *arch = (int *) malloc(sizeof(*arch) * archLen);
-    fread(arch, sizeof(*arch), archLen, networkFile);
+    if (fread(arch, sizeof(*arch), archLen, networkFile) != (size_t) archLen) {
+        fprintf(stderr, "Invalid %s file\n", fileExtension);
+        free(arch);
+        fclose(networkFile);
+        return false;
+    }
 
-    if (!Network_cmpArch(nn, arch, archLen)) {
+    bool same = Network_cmpArch(nn, arch, archLen);
+    free(arch);
+    // a plain file only fits an all dense Network, a layered one must match every layer descriptor
+    for (int i = 0; same && i < nn->count; i++) {
+        int expected[LAYER_DESCRIPTOR_INTS] = {LAYER_DENSE};
+        if (nn->specs)
+            layer_descriptor(&nn->specs[i], expected);
+        if (layered) {
+            int descriptor[LAYER_DESCRIPTOR_INTS];
+            same = fread(descriptor, sizeof(*descriptor), LAYER_DESCRIPTOR_INTS, networkFile) == LAYER_DESCRIPTOR_INTS &&
+                   memcmp(descriptor, expected, sizeof(expected)) == 0;
+        } else {
+            same = (expected[0] == LAYER_DENSE);
+        }
+    }
+    if (!same) {
         fprintf(stderr, "Provided Network architecture is not the same as loaded Network\n");
         fclose(networkFile);
-        return;
+        return false;
     }
-    for (int i = 0; i < nn->count; i++) {
-        fread_matrix(&nn->weights[i], networkFile);
-        fread_matrix(&nn->biases[i], networkFile);
+    bool complete = true;
+    for (int i = 0; complete && i < nn->count; i++) {
+        complete = fread_matrix(&nn->weights[i], networkFile) && fread_matrix(&nn->biases[i], networkFile);
+        if (complete && Network_layer_type(nn, i) == LAYER_GRU)
+            complete = fread_matrix(&nn->specs[i].recurrent, networkFile);
     }
     fclose(networkFile);
-    printf("File loaded successfully\n");
+    if (!complete) {
+        fprintf(stderr, "Invalid %s file, it ends early\n", fileExtension);
+        return false;
+    }
+    return true;
 }
 
 void fwrite_matrix(Matrix *src, FILE *dest) {
@@ -380,12 +1383,17 @@ void fwrite_matrix(Matrix *src, FILE *dest) {
     }
 }
 
-void fread_matrix(Matrix *dest, FILE *src) {
+// false if the file ends before the whole matrix is read
+bool fread_matrix(Matrix *dest, FILE *src) {
     for (int i = 0; i < dest->rows; i++) {
-        fread(&MAT_AT(dest, i, 0), sizeof(*dest->data), dest->cols, src);
-        char temp;                                // could be removed to optimize size
-        fread(&temp, sizeof(fileMatRow), 1, src); // could be removed to optimize size
+        if (fread(&MAT_AT(dest, i, 0), sizeof(*dest->data), dest->cols, src) != (size_t) dest->cols)
+            return false;
+        // the row separator could be removed to optimize size
+        char temp;
+        if (fread(&temp, sizeof(fileMatRow), 1, src) != 1)
+            return false;
     }
+    return true;
 }
 
 void matrix_print(Matrix *m, const char *name, int padding, const char *format) {
@@ -406,12 +1414,96 @@ void print_activation(Activation *a, const char *name, int padding) {
     printf("%*s%s = %s\n", padding, "", name, actName);
 }
 
+AllocPolicy ml_default_alloc_policy(void) {
+    AllocPolicy policy = {
+        .hugePages = false,
+        .node = -1,
+        .interleave = false,
+    };
+    return policy;
+}
+
+_Thread_local AllocPolicy mlAllocPolicy = {.hugePages = false, .node = -1, .interleave = false};
+
+// sets the policy of the calling thread and returns the previous one
+AllocPolicy ml_set_alloc_policy(AllocPolicy policy) {
+    AllocPolicy previous = mlAllocPolicy;
+    mlAllocPolicy = policy;
+    return previous;
+}
+
+int ml_numa_nodes(void) {
+#ifdef ML_USE_LIBNUMA
+    if (numa_available() >= 0)
+        return numa_max_node() + 1;
+#endif
+    return 1;
+}
+
+// NUMA node of the cpu the calling thread is running on right now
+int ml_current_node(void) {
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+        return (int) node;
+#endif
+    return 0;
+}
+
+// calloc following the calling thread's AllocPolicy, the result is always released with free()
+// without ML_USE_LIBNUMA node binding falls back to first touch: the pages land on the node of
+// the thread that zeroes them here
+void *ml_calloc(size_t count, size_t size) {
+    AllocPolicy *policy = &mlAllocPolicy;
+    if (size && count > SIZE_MAX / size)
+        return NULL;
+    size_t bytes = count * size;
+    bool huge = policy->hugePages && bytes >= HUGE_PAGE_SIZE;
+    bool bind = policy->interleave || policy->node >= 0;
+    if (!huge && !bind)
+        return calloc(count, size);
+
+#if defined(_WIN32) || defined(_WIN64)
+    return calloc(count, size);
+#else
+    void *ptr = NULL;
+    size_t alignment = (huge ? HUGE_PAGE_SIZE : 4096);
+    // whole pages, so madvise and the NUMA binding never reach past the allocation
+    if (bytes > SIZE_MAX - (alignment - 1))
+        return NULL;
+    bytes = (bytes + alignment - 1) & ~(alignment - 1);
+    if (posix_memalign(&ptr, alignment, bytes) != 0)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (huge)
+        madvise(ptr, bytes, MADV_HUGEPAGE);
+#endif
+#ifdef ML_USE_LIBNUMA
+    if (bind && numa_available() >= 0) {
+        if (policy->interleave)
+            numa_interleave_memory(ptr, bytes, numa_all_nodes_ptr);
+        else
+            numa_tonode_memory(ptr, bytes, policy->node);
+    }
+#endif
+    // first touch after the policy is in place
+    memset(ptr, 0, bytes);
+    return ptr;
+#endif
+}
+
+// an empty matrix (no data) if a dimension is negative
 Matrix matrix_new(int rows, int cols) {
+    if (rows < 0 || cols < 0) {
+        fprintf(stderr, "Matrix dimensions can not be negative\n");
+        Matrix empty = {0};
+        return empty;
+    }
     Matrix m = {
         .rows = rows,
         .cols = cols,
         .stride = cols,
-        .data = calloc(sizeof(*m.data), rows * cols),
+        .data = ml_calloc(sizeof(*m.data), (size_t) rows * cols),
     };
     return m;
 }
@@ -422,614 +1514,4991 @@ void matrix_free(Matrix *m) {
 }
 
 void matrix_dot(Matrix *dest, Matrix *a, Matrix *b) {
-    if (a->cols != b->rows)
-        return;
-    if (dest->rows != a->rows)
-        return;
-    if (dest->cols != b->cols)
-        return;
-
-    matrix_clear(dest);
-    for (int i = 0; i < dest->rows; i++) {
-        for (int j = 0; j < dest->cols; j++) {
-            for (int k = 0; k < a->cols; k++) {
-                MAT_AT(dest, i, j) += MAT_AT(a, i, k) * MAT_AT(b, k, j);
-            }
-        }
-    }
+    GemmPlan plan = gemm_default_plan();
+    matrix_dot_plan(dest, a, b, &plan);
 }
 
-void matrix_sum(Matrix *dest, Matrix *src) {
-    if (!matrix_same(dest, src))
-        return;
+int ml_cpu_count(void) {
+#if defined(_WIN32) || defined(_WIN64)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int) info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0 ? (int) count : 1);
+#endif
+}
 
-    for (int i = 0; i < dest->rows; i++) {
-        for (int j = 0; j < dest->cols; j++) {
-            MAT_AT(dest, i, j) += MAT_AT(src, i, j);
-        }
-    }
+// monotonic time in seconds
+double ml_time(void) {
+#if defined(_WIN32) || defined(_WIN64)
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double) counter.QuadPart / (double) frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
 }
 
-void matrix_activate(Matrix *m, float (*actFunc)(float)) {
-    for (int i = 0; i < m->rows; i++) {
-        for (int j = 0; j < m->cols; j++) {
-            MAT_AT(m, i, j) = actFunc(MAT_AT(m, i, j));
+void *threadpool_worker(void *arg) {
+    ThreadPool *pool = arg;
+    unsigned long seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->generation == seen) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
         }
-    }
-}
+        if (pool->stop)
+            break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
 
-void matrix_rand(Matrix *m, float low, float high) {
-    for (int i = 0; i < m->rows; i++) {
-        for (int j = 0; j < m->cols; j++) {
-            MAT_AT(m, i, j) = rand_float() * (high - low) + low;
+        for (int i = atomic_fetch_add(&pool->next, 1); i < pool->tasks; i = atomic_fetch_add(&pool->next, 1)) {
+            pool->task(pool->arg, i);
         }
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->finished);
     }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
 }
 
-Matrix matrix_row(Matrix *src, int row) {
-    Matrix m = {0};
-    m.rows = 1;
-    m.cols = src->cols;
-    m.stride = src->stride;
-    m.data = &MAT_AT(src, row, 0);
-    return m;
+// `threads` counts the calling thread, which works on the tasks too
+ThreadPool *ThreadPool_new(int threads) {
+    ThreadPool *pool = calloc(1, sizeof(*pool));
+    pool->count = (threads > 1 ? threads - 1 : 0);
+    pool->threads = calloc(pool->count + 1, sizeof(*pool->threads));
+    pthread_mutex_init(&pool->runLock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    atomic_init(&pool->next, 0);
+    for (int i = 0; i < pool->count; i++) {
+        pthread_create(&pool->threads[i], NULL, threadpool_worker, pool);
+    }
+    return pool;
 }
 
-Matrix matrix_col(Matrix *src, int col) {
-    Matrix m = {0};
-    m.rows = src->rows;
-    m.cols = 1;
-    m.stride = src->stride;
-    m.data = &MAT_AT(src, 0, col);
-    return m;
+void ThreadPool_free(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->runLock);
+    free(pool->threads);
+    free(pool);
 }
 
-void matrix_copy(Matrix *dest, Matrix *src) {
-    if (!matrix_same(dest, src))
+// calls task(arg, i) for every i in [0, tasks) across the pool and waits for all of them
+// while the pool is busy (another caller, or a task calling back in) the tasks run on the calling thread
+void ThreadPool_run(ThreadPool *pool, int tasks, void (*task)(void *arg, int index), void *arg) {
+    if (tasks <= 1 || pool->count == 0) {
+        for (int i = 0; i < tasks; i++) {
+            task(arg, i);
+        }
         return;
+    }
 
-    for (int i = 0; i < dest->rows; i++) {
-        for (int j = 0; j < dest->cols; j++) {
-            MAT_AT(dest, i, j) = MAT_AT(src, i, j);
+    if (pthread_mutex_trylock(&pool->runLock) != 0) {
+        for (int i = 0; i < tasks; i++) {
+            task(arg, i);
         }
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->tasks = tasks;
+    atomic_store(&pool->next, 0);
+    pool->busy = pool->count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = atomic_fetch_add(&pool->next, 1); i < tasks; i = atomic_fetch_add(&pool->next, 1)) {
+        task(arg, i);
     }
-}
 
-void matrix_clear(Matrix *m) {
-    for (int i = 0; i < m->rows; i++) {
-        for (int j = 0; j < m->cols; j++) {
-            MAT_AT(m, i, j) = 0;
-        }
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0) {
+        pthread_cond_wait(&pool->finished, &pool->lock);
     }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->runLock);
 }
 
-bool matrix_same(Matrix *a, Matrix *b) {
-    return ((a->rows == b->rows) && (a->cols == b->cols));
+ThreadPool *mlDefaultPool = NULL;
+pthread_once_t mlDefaultPoolOnce = PTHREAD_ONCE_INIT;
+
+void threadpool_default_init(void) {
+    mlDefaultPool = ThreadPool_new(ml_cpu_count());
 }
 
-bool matrix_equal(Matrix *a, Matrix *b) {
-    if (!matrix_same(a, b))
-        return false;
-    for (int i = 0; i < a->rows; i++) {
-        for (int j = 0; j < a->cols; j++) {
-            if (MAT_AT(a, i, j) != MAT_AT(b, i, j))
-                return false;
+// pool with one thread per cpu, created on first use and shared by the whole program
+ThreadPool *ThreadPool_default(void) {
+    pthread_once(&mlDefaultPoolOnce, threadpool_default_init);
+    return mlDefaultPool;
+}
+
+GemmPlan gemm_default_plan(void) {
+    GemmPlan plan = {
+        .kernel = GEMM_IKJ,
+        .tileRows = 0,
+        .tileInner = 0,
+        .tileCols = 0,
+        .threads = 1,
+    };
+    return plan;
+}
+
+// dest[i0..i1, j0..j1] += a[i0..i1, k0..k1] * b[k0..k1, j0..j1]
+// four rows share every load of b, which is what makes a batch cheaper than its rows one by one
+void gemm_block(Matrix *dest, Matrix *a, Matrix *b, int i0, int i1, int k0, int k1, int j0, int j1) {
+    int i = i0;
+    for (; i + 4 <= i1; i += 4) {
+        float *d0 = &MAT_AT(dest, i, 0);
+        float *d1 = &MAT_AT(dest, i + 1, 0);
+        float *d2 = &MAT_AT(dest, i + 2, 0);
+        float *d3 = &MAT_AT(dest, i + 3, 0);
+        for (int k = k0; k < k1; k++) {
+            float a0 = MAT_AT(a, i, k);
+            float a1 = MAT_AT(a, i + 1, k);
+            float a2 = MAT_AT(a, i + 2, k);
+            float a3 = MAT_AT(a, i + 3, k);
+            float *bRow = &MAT_AT(b, k, 0);
+            for (int j = j0; j < j1; j++) {
+                float bkj = bRow[j];
+                d0[j] += a0 * bkj;
+                d1[j] += a1 * bkj;
+                d2[j] += a2 * bkj;
+                d3[j] += a3 * bkj;
+            }
+        }
+    }
+    for (; i < i1; i++) {
+        float *destRow = &MAT_AT(dest, i, 0);
+        for (int k = k0; k < k1; k++) {
+            float aik = MAT_AT(a, i, k);
+            float *bRow = &MAT_AT(b, k, 0);
+            for (int j = j0; j < j1; j++) {
+                destRow[j] += aik * bRow[j];
+            }
         }
     }
-    return true;
 }
 
-void Network_copy(Network *dest, Network *src) {
-    if (!Network_same(dest, src))
-        return;
-    for (int i = 0; i < dest->count; i++) {
-        matrix_copy(&dest->weights[i], &src->weights[i]);
-        matrix_copy(&dest->biases[i], &src->biases[i]);
+// dest[rows, cols] = a * b over the given block of dest, the block must already be cleared
+void gemm_kernel(Matrix *dest, Matrix *a, Matrix *b, GemmPlan *plan, int rowStart, int rowEnd, int colStart, int colEnd) {
+    int inner = a->cols;
+    switch (plan->kernel) {
+        case GEMM_NAIVE:
+            for (int i = rowStart; i < rowEnd; i++) {
+                for (int j = colStart; j < colEnd; j++) {
+                    for (int k = 0; k < inner; k++) {
+                        MAT_AT(dest, i, j) += MAT_AT(a, i, k) * MAT_AT(b, k, j);
+                    }
+                }
+            }
+            break;
+        case GEMM_IKJ:
+            gemm_block(dest, a, b, rowStart, rowEnd, 0, inner, colStart, colEnd);
+            break;
+        case GEMM_BLOCKED:
+            for (int i0 = rowStart; i0 < rowEnd; i0 += plan->tileRows) {
+                int i1 = (i0 + plan->tileRows < rowEnd ? i0 + plan->tileRows : rowEnd);
+                for (int k0 = 0; k0 < inner; k0 += plan->tileInner) {
+                    int k1 = (k0 + plan->tileInner < inner ? k0 + plan->tileInner : inner);
+                    for (int j0 = colStart; j0 < colEnd; j0 += plan->tileCols) {
+                        int j1 = (j0 + plan->tileCols < colEnd ? j0 + plan->tileCols : colEnd);
+                        gemm_block(dest, a, b, i0, i1, k0, k1, j0, j1);
+                    }
+                }
+            }
+            break;
     }
 }
 
-bool Network_same(Network *a, Network *b) {
-    if (a->count != b->count)
-        return false;
-
-    for (int i = 0; i < a->count; i++) {
-        if (!matrix_same(&a->layers[i], &b->layers[i]))
-            return false;
-        if (!matrix_same(&a->weights[i], &b->weights[i]))
-            return false;
-        if (!matrix_same(&a->biases[i], &b->biases[i]))
-            return false;
+typedef struct GEMM_TASK {
+    Matrix *dest;
+    Matrix *a;
+    Matrix *b;
+    GemmPlan *plan;
+    int parts;
+    bool splitRows;
+} GemmTask;
+
+void gemm_task(void *arg, int index) {
+    GemmTask *t = arg;
+    int total = (t->splitRows ? t->dest->rows : t->dest->cols);
+    int start = (int) ((long) total * index / t->parts);
+    int end = (int) ((long) total * (index + 1) / t->parts);
+    if (t->splitRows) {
+        gemm_kernel(t->dest, t->a, t->b, t->plan, start, end, 0, t->dest->cols);
+    } else {
+        gemm_kernel(t->dest, t->a, t->b, t->plan, 0, t->dest->rows, start, end);
     }
-    return true;
 }
 
-Network NeuralNetwork(int *layers, int layersCount, ActivationType *activations) {
-    Network nn = {0};
-    nn.count = layersCount - 1;
-    nn.layers = calloc(sizeof(*nn.layers), nn.count + 1);
-    nn.weights = calloc(sizeof(*nn.weights), nn.count);
-    nn.biases = calloc(sizeof(*nn.biases), nn.count);
-    nn.activations = (activations ? calloc(sizeof(*nn.activations), nn.count) : NULL);
+// dest = a * b using plan, NULL plan means gemm_default_plan
+void matrix_dot_plan(Matrix *dest, Matrix *a, Matrix *b, GemmPlan *plan) {
+    if (a->cols != b->rows)
+        return;
+    if (dest->rows != a->rows)
+        return;
+    if (dest->cols != b->cols)
+        return;
 
-    nn.layers[0] = matrix_new(1, layers[0]);
-    for (int i = 0; i < nn.count; i++) {
-        nn.weights[i] = matrix_new(layers[i], layers[i + 1]);
-        nn.biases[i] = matrix_new(1, layers[i + 1]);
-        if (activations != NULL) {
-            nn.activations[i].type = activations[i];
-            nn.activations[i].activationFunc = getActFunc(activations[i]);
-        }
-        nn.layers[i + 1] = matrix_new(1, layers[i + 1]);
+    GemmPlan fallback = gemm_default_plan();
+    if (!plan)
+        plan = &fallback;
+
+    matrix_clear(dest);
+    if (plan->threads <= 1) {
+        gemm_kernel(dest, a, b, plan, 0, dest->rows, 0, dest->cols);
+        return;
     }
-    return nn;
+
+    // split rows when there are enough of them, otherwise columns (batch 1 inference)
+    GemmTask task = {
+        .dest = dest,
+        .a = a,
+        .b = b,
+        .plan = plan,
+        .splitRows = (dest->rows >= plan->threads),
+    };
+    int total = (task.splitRows ? dest->rows : dest->cols);
+    task.parts = (plan->threads < total ? plan->threads : total);
+    ThreadPool_run(ThreadPool_default(), task.parts, gemm_task, &task);
 }
 
-void Network_print(Network *nn, const char *name, bool showLayers) {
-    char buff[100];
-    printf("%s = [\n", name);
-    for (int i = 0; i < nn->count; i++) {
-        if (showLayers) {
-            snprintf(buff, sizeof(buff), "%s->layers[%d]", name, i);
-            matrix_print(&nn->layers[i], buff, 4, "%f");
-        }
-        snprintf(buff, sizeof(buff), "%s->weights[%d]", name, i);
-        matrix_print(&nn->weights[i], buff, 4, "%f");
-        snprintf(buff, sizeof(buff), "%s->biases[%d]", name, i);
-        matrix_print(&nn->biases[i], buff, 4, "%f");
-        if (nn->activations) {
-            snprintf(buff, sizeof(buff), "%s->activations[%d]", name, i);
-            print_activation(&nn->activations[i], buff, 4);
-        }
+// times plan on random matrices of the given shape, returns the best of a few runs in seconds
+double gemm_benchmark(Matrix *dest, Matrix *a, Matrix *b, GemmPlan *plan) {
+    double best = 1e30;
+    int repeats = 1;
+    // repeat tiny products so a single run is not just timer noise
+    while ((double) repeats * a->rows * a->cols * b->cols < 1e6 && repeats < 1024) {
+        repeats *= 2;
     }
-    if (showLayers) {
-        snprintf(buff, sizeof(buff), "%s->layers[%d]", name, nn->count);
-        matrix_print(&nn->layers[nn->count], buff, 4, "%f");
+    for (int run = 0; run < 3; run++) {
+        double start = ml_time();
+        for (int r = 0; r < repeats; r++) {
+            matrix_dot_plan(dest, a, b, plan);
+        }
+        double elapsed = (ml_time() - start) / repeats;
+        if (elapsed < best)
+            best = elapsed;
     }
-    printf("]\n");
+    return best;
 }
 
-void Network_rand(Network *nn, float low, float high) {
-    for (int i = 0; i < nn->count; i++) {
-        matrix_rand(&nn->weights[i], low, high);
-        matrix_rand(&nn->biases[i], low, high);
+// benchmarks the candidate kernels, tile sizes and thread counts for one product shape
+GemmPlan gemm_tune(int rows, int inner, int cols) {
+    Matrix a = matrix_new(rows, inner);
+    Matrix b = matrix_new(inner, cols);
+    Matrix dest = matrix_new(rows, cols);
+    Rng rng = Rng_new(rows * 31 + inner * 17 + cols, 0);
+    matrix_rand_rng(&a, &rng, -1.f, 1.f);
+    matrix_rand_rng(&b, &rng, -1.f, 1.f);
+
+    static const int tiles[] = {16, 64, 256};
+    int cpus = ml_cpu_count();
+    GemmPlan best = gemm_default_plan();
+    double bestTime = gemm_benchmark(&dest, &a, &b, &best);
+
+    for (int threads = 1; threads <= cpus; threads *= 2) {
+        // splitting small products costs more than it saves
+        if (threads > 1 && (double) rows * inner * cols < 65536.0 * threads)
+            break;
+
+        GemmPlan plan = gemm_default_plan();
+        plan.threads = threads;
+        double t = gemm_benchmark(&dest, &a, &b, &plan);
+        if (t < bestTime) {
+            bestTime = t;
+            best = plan;
+        }
+
+        plan.kernel = GEMM_BLOCKED;
+        for (int ti = 0; ti < (int) ARR_LEN(tiles); ti++) {
+            for (int tk = 0; tk < (int) ARR_LEN(tiles); tk++) {
+                for (int tj = 0; tj < (int) ARR_LEN(tiles); tj++) {
+                    if (tiles[ti] > rows * 2 || tiles[tk] > inner * 2 || tiles[tj] > cols * 2)
+                        continue;
+                    plan.tileRows = tiles[ti];
+                    plan.tileInner = tiles[tk];
+                    plan.tileCols = tiles[tj];
+                    t = gemm_benchmark(&dest, &a, &b, &plan);
+                    if (t < bestTime) {
+                        bestTime = t;
+                        best = plan;
+                    }
+                }
+            }
+        }
     }
+
+    matrix_free(&a);
+    matrix_free(&b);
+    matrix_free(&dest);
+    return best;
 }
 
-void Network_clear(Network *nn) {
-    for (int i = 0; i < nn->count; i++) {
-        matrix_clear(&nn->layers[i]);
-        matrix_clear(&nn->weights[i]);
-        matrix_clear(&nn->biases[i]);
+// identifies the machine in the plan cache, plans tuned on another cpu are ignored
+void gemm_cpu_name(char *name, int size) {
+    snprintf(name, size, "unknown");
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    unsigned int brand[12];
+    if (__get_cpuid_max(0x80000000, NULL) >= 0x80000004) {
+        for (int i = 0; i < 3; i++) {
+            __get_cpuid(0x80000002 + i, &brand[i * 4], &brand[i * 4 + 1], &brand[i * 4 + 2], &brand[i * 4 + 3]);
+        }
+        snprintf(name, size, "%.48s", (char *) brand);
     }
-    matrix_clear(&nn->layers[nn->count]);
+#else
+    FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+    if (cpuinfo) {
+        char line[256];
+        while (fgets(line, sizeof(line), cpuinfo)) {
+            char *value = strchr(line, ':');
+            if (value && (!strncmp(line, "model name", 10) || !strncmp(line, "Model", 5))) {
+                snprintf(name, size, "%s", value + 2);
+                break;
+            }
+        }
+        fclose(cpuinfo);
+    }
+#endif
+    // the cache is whitespace separated, so keep the name a single token
+    int length = 0;
+    for (int i = 0; name[i]; i++) {
+        if (name[i] == '\n')
+            break;
+        if (name[i] == ' ' || name[i] == '\t') {
+            if (length == 0 || name[length - 1] == '_')
+                continue;
+            name[length++] = '_';
+        } else {
+            name[length++] = name[i];
+        }
+    }
+    while (length > 0 && name[length - 1] == '_') {
+        length--;
+    }
+    name[length] = '\0';
+    snprintf(name + length, size - length, "/%d", ml_cpu_count());
 }
 
-float Network_cost(Network *nn, Matrix *in, Matrix *out) {
-    if (NETWORK_IN(nn).cols != in->cols)
-        return -1.f;
-    if (NETWORK_OUT(nn).cols != out->cols)
-        return -1.f;
-
-    float result = 0.f;
-    for (int i = 0; i < in->rows; i++) {
-        Matrix in_row = matrix_row(in, i);
-        matrix_copy(&NETWORK_IN(nn), &in_row);
-        Network_forward(nn);
+// whether a plan read back from the cache can run: tiles for the blocked kernel and a thread count
+// this machine has
+bool gemm_plan_valid(GemmPlan *plan) {
+    if (plan->kernel == GEMM_BLOCKED && (plan->tileRows <= 0 || plan->tileInner <= 0 || plan->tileCols <= 0))
+        return false;
+    return plan->threads >= 1 && plan->threads <= ml_cpu_count();
+}
 
-        for (int j = 0; j < out->cols; j++) {
-            float d = MAT_AT(&NETWORK_OUT(nn), 0, j) - MAT_AT(out, i, j);
-            result += d * d;
+// looks for a plan of this cpu and shape in the cache file
+// stale or corrupt lines are skipped, so a shape without a usable line gets tuned again
+bool gemm_cache_find(FILE *cache, const char *cpu, int rows, int inner, int cols, GemmPlan *plan) {
+    char name[128];
+    int r, k, c, kernel;
+    GemmPlan found;
+    rewind(cache);
+    while (fscanf(cache, "%127s %d %d %d %d %d %d %d %d", name, &r, &k, &c, &kernel,
+                  &found.tileRows, &found.tileInner, &found.tileCols, &found.threads) == 9) {
+        if (r == rows && k == inner && c == cols && !strcmp(name, cpu)) {
+            if (kernel < GEMM_NAIVE || kernel > GEMM_BLOCKED)
+                continue;
+            found.kernel = (GemmKernel) kernel;
+            if (!gemm_plan_valid(&found))
+                continue;
+            *plan = found;
+            return true;
         }
     }
-
-    return result / in->rows;
+    return false;
 }
 
-float Network_Q_cost(Network *nn, Step *steps, int stepAmount, Matrix *Qtargets) {
-    if (!stepAmount)
-        return 0;
-    if (stepAmount != Qtargets->rows)
-        return -1.f;
-
-    float result = 0.0f;
-    for (int i = 0; i < stepAmount; i++) {
-        matrix_copy(&NETWORK_IN(nn), &steps[i].state);
-        Network_forward(nn);
-        float d = (MAT_AT(&NETWORK_IN(nn), 0, steps[i].action) - MAT_AT(Qtargets, i, 0));
-        result += d * d;
+// plan for the product of layer `layer` with a batch of `batch` rows, NULL if not tuned
+GemmPlan *Network_plan(Network *nn, int layer, int batch) {
+    if (!nn->plans)
+        return NULL;
+    int bucket = 0;
+    while ((1 << bucket) < batch && bucket < GEMM_PLAN_BATCHES - 1) {
+        bucket++;
     }
-    return result / stepAmount;
+    GemmPlan *plan = &nn->plans[layer * GEMM_PLAN_BATCHES + bucket];
+    return (plan->threads > 0 ? plan : NULL);
 }
 
-float Network_cross_entropy_loss(Network *nn, Step *steps, int stepAmount) {
-    (void) nn;
-
-    float cost = 0.f;
-    for (int i = 0; i < stepAmount; i++) {
-        float prob = steps[i].output;
-        if (steps[i].reward != 0 && prob > 0) {
-            cost += steps[i].reward * -log(prob);
-        }
+// default plan cache, $ML_GEMM_CACHE or GEMM_PLAN_CACHE in the user's cache directory
+// false if neither is known
+bool gemm_cache_path(char *path, int size) {
+    const char *env = getenv(GEMM_PLAN_CACHE_ENV);
+    if (env && *env)
+        return snprintf(path, size, "%s", env) < size;
+#if defined(_WIN32) || defined(_WIN64)
+    const char *dir = getenv("LOCALAPPDATA");
+    if (dir && *dir)
+        return snprintf(path, size, "%s\\%s", dir, GEMM_PLAN_CACHE) < size;
+#else
+    const char *dir = getenv("XDG_CACHE_HOME");
+    if (dir && *dir)
+        return snprintf(path, size, "%s/%s", dir, GEMM_PLAN_CACHE) < size;
+    dir = getenv("HOME");
+    if (dir && *dir) {
+        // ~/.cache is not there on every system
+        if (snprintf(path, size, "%s/.cache", dir) >= size)
+            return false;
+        mkdir(path, 0700);
+        return snprintf(path, size, "%s/.cache/%s", dir, GEMM_PLAN_CACHE) < size;
     }
-    return cost;
+#endif
+    return false;
 }
 
-void Network_forward(Network *nn) {
-    for (int i = 0; i < nn->count; i++) {
-        matrix_dot(&nn->layers[i + 1], &nn->layers[i], &nn->weights[i]);
-        matrix_sum(&nn->layers[i + 1], &nn->biases[i]);
-        if (nn->activations) {
-            if (nn->activations[i].type == SOFTMAX) {
-                softmaxf(&nn->layers[i + 1]);
-            } else if (nn->activations[i].activationFunc) {
-                matrix_activate(&nn->layers[i + 1], nn->activations[i].activationFunc);
+// tunes every layer for the given batch sizes (rounded up to powers of two)
+// plans already in the cache file for this cpu are reused, new ones are appended to it
+// NULL cachePath uses gemm_cache_path, so the cache does not depend on the working directory
+void Network_autotune(Network *nn, int *batches, int batchCount, const char *cachePath) {
+    char defaultPath[1024];
+    if (!cachePath && gemm_cache_path(defaultPath, sizeof(defaultPath)))
+        cachePath = defaultPath;
+    if (!nn->plans)
+        nn->plans = calloc(sizeof(*nn->plans), nn->count * GEMM_PLAN_BATCHES);
+
+    char cpu[128];
+    gemm_cpu_name(cpu, sizeof(cpu));
+    FILE *cache = (cachePath ? fopen(cachePath, "a+") : NULL);
+    if (!cache)
+        fprintf(stderr, "Plan cache could not be opened, tuning without it\n");
+
+    for (int b = 0; b < batchCount; b++) {
+        int bucket = 0;
+        while ((1 << bucket) < batches[b] && bucket < GEMM_PLAN_BATCHES - 1) {
+            bucket++;
+        }
+        for (int i = 0; i < nn->count; i++) {
+            GemmPlan *plan = &nn->plans[i * GEMM_PLAN_BATCHES + bucket];
+            int rows = 1 << bucket;
+            int inner = nn->weights[i].rows;
+            int cols = nn->weights[i].cols;
+            if (!inner || !cols)
+                continue;
+            // a convolution multiplies one row per output position
+            if (Network_layer_type(nn, i) == LAYER_CONV2D)
+                rows *= nn->specs[i].outHeight * nn->specs[i].outWidth;
+            if (cache && gemm_cache_find(cache, cpu, rows, inner, cols, plan))
+                continue;
+
+            *plan = gemm_tune(rows, inner, cols);
+            if (cache) {
+                fseek(cache, 0, SEEK_END);
+                fprintf(cache, "%s %d %d %d %d %d %d %d %d\n", cpu, rows, inner, cols, plan->kernel,
+                        plan->tileRows, plan->tileInner, plan->tileCols, plan->threads);
+                fflush(cache);
             }
         }
     }
+    if (cache)
+        fclose(cache);
 }
 
-void Network_diff(Network *nn, Network *g, float eps, Matrix *in, Matrix *out) {
-    if (in->rows != out->rows)
-        return;
-    Matrix in_row = matrix_row(in, 0);
-    if (!matrix_same(&NETWORK_IN(nn), &in_row))
+// dest += a^T * b
+void matrix_dot_at(Matrix *dest, Matrix *a, Matrix *b) {
+    if (a->rows != b->rows)
         return;
-    Matrix out_row = matrix_row(out, 0);
-    if (!matrix_same(&NETWORK_OUT(nn), &out_row))
+    if (dest->rows != a->cols)
         return;
-    if (!Network_same(nn, g))
+    if (dest->cols != b->cols)
         return;
 
-    float saved;
-    float cost = Network_cost(nn, in, out);
-    for (int i = 0; i < nn->count; i++) {
-        Matrix *weights = &nn->weights[i];
-        for (int j = 0; j < weights->rows; j++) {
-            for (int k = 0; k < weights->cols; k++) {
-                saved = MAT_AT(weights, j, k);
-                MAT_AT(weights, j, k) += eps;
-                float newCost = Network_cost(nn, in, out);
-                MAT_AT(&g->weights[i], j, k) = (newCost - cost) / eps;
-                MAT_AT(weights, j, k) = saved;
-            }
-        }
-
-        Matrix *biases = &nn->biases[i];
-        for (int j = 0; j < biases->rows; j++) {
-            for (int k = 0; k < biases->cols; k++) {
-                saved = MAT_AT(biases, j, k);
-                MAT_AT(biases, j, k) += eps;
-                float newCost = Network_cost(nn, in, out);
-                MAT_AT(&g->biases[i], j, k) = (newCost - cost) / eps;
-                MAT_AT(biases, j, k) = saved;
+    for (int k = 0; k < a->rows; k++) {
+        for (int i = 0; i < dest->rows; i++) {
+            float aki = MAT_AT(a, k, i);
+            for (int j = 0; j < dest->cols; j++) {
+                MAT_AT(dest, i, j) += aki * MAT_AT(b, k, j);
             }
         }
     }
 }
 
-void Network_policy_gradient_diff(Network *nn, Network *g, float eps, Step *steps, int stepAmount) {
-    if (!steps)
+// dest = a * b^T
+void matrix_dot_bt(Matrix *dest, Matrix *a, Matrix *b) {
+    if (a->cols != b->cols)
         return;
-    if (!matrix_same(&NETWORK_IN(nn), &steps[0].state))
+    if (dest->rows != a->rows)
         return;
-    if (!Network_same(nn, g))
+    if (dest->cols != b->rows)
         return;
 
-    float saved;
-    float cost = Network_cross_entropy_loss(nn, steps, stepAmount);
-    for (int i = 0; i < nn->count; i++) {
-        Matrix *weights = &nn->weights[i];
-        for (int j = 0; j < weights->rows; j++) {
-            for (int k = 0; k < weights->cols; k++) {
-                saved = MAT_AT(weights, j, k);
-                MAT_AT(weights, j, k) += eps;
-                float newCost = Network_cross_entropy_loss(nn, steps, stepAmount);
-                MAT_AT(&g->weights[i], j, k) = (newCost - cost) / eps;
-                MAT_AT(weights, j, k) = saved;
+    for (int i = 0; i < dest->rows; i++) {
+        for (int j = 0; j < dest->cols; j++) {
+            float sum = 0.f;
+            for (int k = 0; k < a->cols; k++) {
+                sum += MAT_AT(a, i, k) * MAT_AT(b, j, k);
             }
-        }
-
-        Matrix *biases = &nn->biases[i];
-        for (int k = 0; k < biases->cols; k++) {
-            saved = MAT_AT(biases, 0, k);
-            MAT_AT(biases, 0, k) += eps;
-            float newCost = Network_cross_entropy_loss(nn, steps, stepAmount);
-            MAT_AT(&g->biases[i], 0, k) = (newCost - cost) / eps;
-            MAT_AT(biases, 0, k) = saved;
+            MAT_AT(dest, i, j) = sum;
         }
     }
 }
 
-void Network_backprop(Network *nn, Network *g, Matrix *in, Matrix *out) {
-    if (in->rows != out->rows)
-        return;
-    Matrix in_row = matrix_row(in, 0);
-    if (!matrix_same(&NETWORK_IN(nn), &in_row))
-        return;
-    Matrix out_row = matrix_row(out, 0);
-    if (!matrix_same(&NETWORK_OUT(nn), &out_row))
-        return;
-    if (!Network_same(nn, g))
+void matrix_sum(Matrix *dest, Matrix *src) {
+    if (!matrix_same(dest, src))
         return;
-    int n = in->rows; // amount of samples
-
-    Network_clear(g);
-
-    // i = current sample
-    // l = current layer
-    // j = current "node"
-    // k = previous "node"
-
-    for (int i = 0; i < n; i++) {
-        Matrix cur_row = matrix_row(in, i);
-        matrix_copy(&NETWORK_IN(nn), &cur_row);
-        Network_forward(nn);
-
-        for (int j = 0; j <= g->count; j++) {
-            matrix_clear(&g->layers[j]);
-        }
 
-        for (int j = 0; j < out->cols; j++) {
-            MAT_AT(&NETWORK_OUT(g), 0, j) = 2 * (MAT_AT(&NETWORK_OUT(nn), 0, j) - MAT_AT(out, i, j));
+    for (int i = 0; i < dest->rows; i++) {
+        for (int j = 0; j < dest->cols; j++) {
+            MAT_AT(dest, i, j) += MAT_AT(src, i, j);
         }
+    }
+}
 
-        for (int l = nn->count; l > 0; l--) {
-            for (int j = 0; j < nn->layers[l].cols; j++) {
-                float outputAhead = MAT_AT(&nn->layers[l], 0, j);
-                float derivativeAhead = MAT_AT(&g->layers[l], 0, j);
-                float activationDerivative = 1.0f;
-                if (nn->activations && nn->activations[l - 1].activationFunc) {
-                    float (*derivativeFunc)(float) = getActDerivative(nn->activations[l - 1].type);
-                    if (derivativeFunc) {
-                        activationDerivative = derivativeFunc(outputAhead);
-                    }
-                }
-                float fullDerivative = (derivativeAhead * activationDerivative);
-                MAT_AT(&g->biases[l - 1], 0, j) += (fullDerivative);
-
-                for (int k = 0; k < nn->layers[l - 1].cols; k++) {
-                    // j - weights matrix col
-                    // k = weights matrix row
-                    float prevInput = MAT_AT(&nn->layers[l - 1], 0, k);
-                    MAT_AT(&g->weights[l - 1], k, j) += (fullDerivative * prevInput);
+// adds a single row to every row of dest (bias broadcast)
+void matrix_add_row(Matrix *dest, Matrix *row) {
+    if (row->rows != 1 || dest->cols != row->cols)
+        return;
 
-                    float prevWeight = MAT_AT(&nn->weights[l - 1], k, j);
-                    MAT_AT(&g->layers[l - 1], 0, k) += (fullDerivative * prevWeight);
-                }
-            }
+    for (int i = 0; i < dest->rows; i++) {
+        for (int j = 0; j < dest->cols; j++) {
+            MAT_AT(dest, i, j) += MAT_AT(row, 0, j);
         }
     }
+}
 
-    for (int i = 0; i < g->count; i++) {
-        Matrix *curWeights = &g->weights[i];
-        for (int j = 0; j < curWeights->rows; j++) {
-            for (int k = 0; k < curWeights->cols; k++) {
-                MAT_AT(curWeights, j, k) /= n;
-            }
+void matrix_activate(Matrix *m, float (*actFunc)(float)) {
+    for (int i = 0; i < m->rows; i++) {
+        for (int j = 0; j < m->cols; j++) {
+            MAT_AT(m, i, j) = actFunc(MAT_AT(m, i, j));
         }
+    }
+}
 
-        Matrix *curBiases = &g->biases[i];
-        for (int k = 0; k < curBiases->cols; k++) {
-            MAT_AT(curBiases, 0, k) /= n;
-        }
+void matrix_apply_activation(Matrix *m, Activation *a) {
+    if (a->type == SOFTMAX) {
+        softmaxf(m);
+    } else if (a->activationFunc) {
+        matrix_activate(m, a->activationFunc);
     }
 }
 
-void Network_Q_backprop(Network *nn, Network *g, Matrix *Qtargets, Step *steps, int *stepIndexes) {
-    if (!Network_same(nn, g))
-        return;
-    int n = Qtargets->rows; // amount of samples
+void matrix_rand(Matrix *m, float low, float high) {
+    matrix_rand_rng(m, rng_thread(), low, high);
+}
+
+void matrix_rand_rng(Matrix *m, Rng *rng, float low, float high) {
+    for (int i = 0; i < m->rows; i++) {
+        Rng_fill_uniform(rng, &MAT_AT(m, i, 0), m->cols, low, high);
+    }
+}
+
+void matrix_randn_rng(Matrix *m, Rng *rng, float mean, float std) {
+    for (int i = 0; i < m->rows; i++) {
+        Rng_fill_normal(rng, &MAT_AT(m, i, 0), m->cols, mean, std);
+    }
+}
+
+Matrix matrix_row(Matrix *src, int row) {
+    Matrix m = {0};
+    m.rows = 1;
+    m.cols = src->cols;
+    m.stride = src->stride;
+    m.data = &MAT_AT(src, row, 0);
+    return m;
+}
+
+// view of `count` consecutive rows starting at `row`
+Matrix matrix_rows(Matrix *src, int row, int count) {
+    Matrix m = {0};
+    m.rows = count;
+    m.cols = src->cols;
+    m.stride = src->stride;
+    m.data = &MAT_AT(src, row, 0);
+    return m;
+}
+
+// view of `count` consecutive columns starting at `col`
+Matrix matrix_cols(Matrix *src, int col, int count) {
+    Matrix m = {0};
+    m.rows = src->rows;
+    m.cols = count;
+    m.stride = src->stride;
+    m.data = &MAT_AT(src, 0, col);
+    return m;
+}
+
+// the same contiguous floats seen as rows x cols, src must not be a column view
+Matrix matrix_reshape(Matrix *src, int rows, int cols) {
+    Matrix m = {0};
+    if (src->stride != src->cols && src->rows > 1)
+        return m;
+    if ((long) rows * cols != (long) src->rows * src->cols)
+        return m;
+    m.rows = rows;
+    m.cols = cols;
+    m.stride = cols;
+    m.data = src->data;
+    return m;
+}
+
+Matrix matrix_col(Matrix *src, int col) {
+    Matrix m = {0};
+    m.rows = src->rows;
+    m.cols = 1;
+    m.stride = src->stride;
+    m.data = &MAT_AT(src, 0, col);
+    return m;
+}
+
+void matrix_copy(Matrix *dest, Matrix *src) {
+    if (!matrix_same(dest, src))
+        return;
+
+    for (int i = 0; i < dest->rows; i++) {
+        for (int j = 0; j < dest->cols; j++) {
+            MAT_AT(dest, i, j) = MAT_AT(src, i, j);
+        }
+    }
+}
+
+void matrix_clear(Matrix *m) {
+    for (int i = 0; i < m->rows; i++) {
+        for (int j = 0; j < m->cols; j++) {
+            MAT_AT(m, i, j) = 0;
+        }
+    }
+}
+
+bool matrix_same(Matrix *a, Matrix *b) {
+    return ((a->rows == b->rows) && (a->cols == b->cols));
+}
+
+bool matrix_equal(Matrix *a, Matrix *b) {
+    if (!matrix_same(a, b))
+        return false;
+    for (int i = 0; i < a->rows; i++) {
+        for (int j = 0; j < a->cols; j++) {
+            if (MAT_AT(a, i, j) != MAT_AT(b, i, j))
+                return false;
+        }
+    }
+    return true;
+}
+
+LayerType Network_layer_type(Network *nn, int layer) {
+    return (nn->specs ? nn->specs[layer].type : LAYER_DENSE);
+}
+
+bool Network_is_recurrent(Network *nn) {
+    for (int i = 0; i < nn->count; i++) {
+        if (Network_layer_type(nn, i) == LAYER_GRU)
+            return true;
+    }
+    return false;
+}
+
+// NULL when nn has no recurrent layers
+RecurrentState *recurrent_state_new(Network *nn, int streams, int batch) {
+    if (!Network_is_recurrent(nn))
+        return NULL;
+    RecurrentState *rs = calloc(sizeof(*rs), nn->count);
+    for (int i = 0; i < nn->count; i++) {
+        if (Network_layer_type(nn, i) != LAYER_GRU)
+            continue;
+        int units = nn->layers[i + 1].cols;
+        rs[i].hidden = matrix_new(streams, units);
+        rs[i].initial = matrix_new(streams, units);
+        rs[i].gates = matrix_new(batch, 4 * units);
+        rs[i].recur = matrix_new(streams, 3 * units);
+    }
+    return rs;
+}
+
+void recurrent_state_free(RecurrentState *rs, int count) {
+    if (!rs)
+        return;
+    for (int i = 0; i < count; i++) {
+        matrix_free(&rs[i].hidden);
+        matrix_free(&rs[i].initial);
+        matrix_free(&rs[i].gates);
+        matrix_free(&rs[i].recur);
+    }
+    free(rs);
+}
+
+RecurrentDeltas *recurrent_deltas_new(Network *nn, int streams, int batch) {
+    if (!Network_is_recurrent(nn))
+        return NULL;
+    RecurrentDeltas *rd = calloc(sizeof(*rd), nn->count);
+    for (int i = 0; i < nn->count; i++) {
+        if (Network_layer_type(nn, i) != LAYER_GRU)
+            continue;
+        int units = nn->layers[i + 1].cols;
+        rd[i].gates = matrix_new(batch, 6 * units);
+        rd[i].carry = matrix_new(streams, units);
+        rd[i].recur = matrix_new(streams, units);
+    }
+    return rd;
+}
+
+void recurrent_deltas_free(RecurrentDeltas *rd, int count) {
+    if (!rd)
+        return;
+    for (int i = 0; i < count; i++) {
+        matrix_free(&rd[i].gates);
+        matrix_free(&rd[i].carry);
+        matrix_free(&rd[i].recur);
+    }
+    free(rd);
+}
+
+void Network_copy(Network *dest, Network *src) {
+    if (!Network_same(dest, src))
+        return;
+    for (int i = 0; i < dest->count; i++) {
+        matrix_copy(&dest->weights[i], &src->weights[i]);
+        matrix_copy(&dest->biases[i], &src->biases[i]);
+        if (Network_layer_type(dest, i) == LAYER_GRU)
+            matrix_copy(&dest->specs[i].recurrent, &src->specs[i].recurrent);
+    }
+}
+
+bool layer_same(Layer *a, Layer *b) {
+    return a->type == b->type && a->kernel == b->kernel && a->stride == b->stride && a->padding == b->padding &&
+           a->channels == b->channels && a->height == b->height && a->width == b->width;
+}
+
+bool Network_same(Network *a, Network *b) {
+    if (a->count != b->count)
+        return false;
+
+    for (int i = 0; i < a->count; i++) {
+        if (!matrix_same(&a->layers[i], &b->layers[i]))
+            return false;
+        if (!matrix_same(&a->weights[i], &b->weights[i]))
+            return false;
+        if (!matrix_same(&a->biases[i], &b->biases[i]))
+            return false;
+        if (Network_layer_type(a, i) != Network_layer_type(b, i))
+            return false;
+        if (a->specs && b->specs && !layer_same(&a->specs[i], &b->specs[i]))
+            return false;
+    }
+    return true;
+}
+
+Network NeuralNetwork(int *layers, int layersCount, ActivationType *activations) {
+    return LayeredNetwork(layers, layersCount, activations, NULL);
+}
+
+Layer Layer_dense(int units) {
+    Layer layer = {.type = LAYER_DENSE, .units = units};
+    return layer;
+}
+
+Layer Layer_gru(int units) {
+    Layer layer = {.type = LAYER_GRU, .units = units};
+    return layer;
+}
+
+// stride 0 means 1
+Layer Layer_conv2d(int filters, int kernel, int stride, int padding) {
+    Layer layer = {
+        .type = LAYER_CONV2D,
+        .filters = filters,
+        .kernel = kernel,
+        .stride = (stride > 0 ? stride : 1),
+        .padding = padding,
+    };
+    return layer;
+}
+
+// non overlapping size x size windows
+Layer Layer_maxpool(int size) {
+    Layer layer = {.type = LAYER_MAXPOOL, .kernel = size, .stride = size};
+    return layer;
+}
+
+Layer Layer_avgpool(int size) {
+    Layer layer = {.type = LAYER_AVGPOOL, .kernel = size, .stride = size};
+    return layer;
+}
+
+// floats of im2col workspace the convolutions of nn need for `batch` rows, 0 without convolutions
+size_t network_columns(Network *nn, int batch) {
+    size_t most = 0;
+    for (int i = 0; i < nn->count; i++) {
+        if (Network_layer_type(nn, i) != LAYER_CONV2D)
+            continue;
+        Layer *spec = &nn->specs[i];
+        size_t size = (size_t) batch * spec->outHeight * spec->outWidth * spec->kernel * spec->kernel * spec->channels;
+        if (size > most)
+            most = size;
+    }
+    return most;
+}
+
+float *network_columns_new(Network *nn, int batch) {
+    size_t size = network_columns(nn, batch);
+    return (size ? ml_calloc(size, sizeof(float)) : NULL);
+}
+
+// specs (NULL for all dense) must already have their shapes filled in
+Network network_new(int *layers, int layersCount, ActivationType *activations, Layer *specs) {
+    Network nn = {0};
+    nn.count = layersCount - 1;
+    nn.layers = calloc(sizeof(*nn.layers), nn.count + 1);
+    nn.weights = calloc(sizeof(*nn.weights), nn.count);
+    nn.biases = calloc(sizeof(*nn.biases), nn.count);
+    nn.activations = (activations ? calloc(sizeof(*nn.activations), nn.count) : NULL);
+    nn.specs = (specs ? calloc(sizeof(*nn.specs), nn.count) : NULL);
+
+    nn.layers[0] = matrix_new(1, layers[0]);
+    for (int i = 0; i < nn.count; i++) {
+        int rows = layers[i];
+        int cols = layers[i + 1];
+        if (specs) {
+            nn.specs[i] = specs[i];
+            nn.specs[i].recurrent = (Matrix) {0};
+            switch (specs[i].type) {
+                case LAYER_DENSE:
+                    break;
+                case LAYER_GRU:
+                    cols = 3 * layers[i + 1];
+                    nn.specs[i].recurrent = matrix_new(layers[i + 1], cols);
+                    break;
+                case LAYER_CONV2D:
+                    rows = specs[i].kernel * specs[i].kernel * specs[i].channels;
+                    cols = specs[i].filters;
+                    break;
+                case LAYER_MAXPOOL:
+                case LAYER_AVGPOOL:
+                    rows = 0;
+                    cols = 0;
+                    break;
+            }
+        }
+        nn.weights[i] = matrix_new(rows, cols);
+        nn.biases[i] = matrix_new((cols ? 1 : 0), cols);
+        if (activations != NULL) {
+            nn.activations[i].type = activations[i];
+            nn.activations[i].activationFunc = getActFunc(activations[i]);
+        }
+        nn.layers[i + 1] = matrix_new(1, layers[i + 1]);
+    }
+    if (Network_is_recurrent(&nn)) {
+        nn.recurrent = recurrent_state_new(&nn, 1, 1);
+        nn.recurrentDeltas = recurrent_deltas_new(&nn, 1, 1);
+    }
+    nn.columns = network_columns_new(&nn, 1);
+    nn.columnDeltas = network_columns_new(&nn, 1);
+#ifdef ML_AUTOTUNE
+    int batches[] = {1, 32, 256};
+    Network_autotune(&nn, batches, ARR_LEN(batches), NULL);
+#endif
+    return nn;
+}
+
+// types has layersCount - 1 entries, types[i] is the layer from layers[i] to layers[i + 1]
+// NULL types makes every layer dense, image layers need ShapedNetwork
+Network LayeredNetwork(int *layers, int layersCount, ActivationType *activations, LayerType *types) {
+    if (!types)
+        return network_new(layers, layersCount, activations, NULL);
+
+    Layer *specs = calloc(sizeof(*specs), layersCount - 1);
+    for (int i = 0; i < layersCount - 1; i++) {
+        if (types[i] != LAYER_DENSE && types[i] != LAYER_GRU) {
+            fprintf(stderr, "Image layers need ShapedNetwork\n");
+            free(specs);
+            return (Network) {0};
+        }
+        specs[i].type = types[i];
+        specs[i].units = layers[i + 1];
+    }
+    Network nn = network_new(layers, layersCount, activations, specs);
+    free(specs);
+    return nn;
+}
+
+// network over channels x height x width inputs (stored channels last) built from Layer_* descriptions
+// image layers keep the image shape, dense and recurrent layers flatten it
+Network ShapedNetwork(int channels, int height, int width, Layer *layers, int count, ActivationType *activations) {
+    Layer *specs = malloc(sizeof(*specs) * count);
+    int *sizes = malloc(sizeof(*sizes) * (count + 1));
+    sizes[0] = channels * height * width;
+    for (int i = 0; i < count; i++) {
+        Layer *spec = &specs[i];
+        *spec = layers[i];
+        spec->channels = channels;
+        spec->height = height;
+        spec->width = width;
+        if (spec->type == LAYER_DENSE || spec->type == LAYER_GRU) {
+            channels = spec->units;
+            height = 1;
+            width = 1;
+        } else {
+            if (spec->stride <= 0)
+                spec->stride = (spec->type == LAYER_CONV2D ? 1 : spec->kernel);
+            if (spec->type != LAYER_CONV2D)
+                spec->padding = 0;
+            spec->outHeight = (height + 2 * spec->padding - spec->kernel) / spec->stride + 1;
+            spec->outWidth = (width + 2 * spec->padding - spec->kernel) / spec->stride + 1;
+            if (spec->kernel <= 0 || spec->outHeight <= 0 || spec->outWidth <= 0) {
+                fprintf(stderr, "Layer %d does not fit its %d x %d input\n", i, height, width);
+                free(specs);
+                free(sizes);
+                return (Network) {0};
+            }
+            if (spec->type == LAYER_CONV2D)
+                channels = spec->filters;
+            height = spec->outHeight;
+            width = spec->outWidth;
+        }
+        sizes[i + 1] = channels * height * width;
+    }
+    Network nn = network_new(sizes, count + 1, activations, specs);
+    free(specs);
+    free(sizes);
+    return nn;
+}
+
+// allocates a Network with the same architecture and activations as src and copies its parameters
+Network Network_clone(Network *src) {
+    int *arch = Network_getArch(src);
+    ActivationType *activations = NULL;
+    if (src->activations) {
+        activations = malloc(sizeof(*activations) * src->count);
+        for (int i = 0; i < src->count; i++) {
+            activations[i] = src->activations[i].type;
+        }
+    }
+    Network nn = network_new(arch, src->count + 1, activations, src->specs);
+    Network_copy(&nn, src);
+    if (src->plans) {
+        free(nn.plans);
+        nn.plans = malloc(sizeof(*nn.plans) * src->count * GEMM_PLAN_BATCHES);
+        memcpy(nn.plans, src->plans, sizeof(*nn.plans) * src->count * GEMM_PLAN_BATCHES);
+    }
+    free(activations);
+    free(arch);
+    return nn;
+}
+
+void Network_free(Network *nn) {
+    for (int i = 0; i < nn->count; i++) {
+        matrix_free(&nn->layers[i]);
+        matrix_free(&nn->weights[i]);
+        matrix_free(&nn->biases[i]);
+    }
+    if (nn->layers)
+        matrix_free(&nn->layers[nn->count]);
+    if (nn->specs) {
+        for (int i = 0; i < nn->count; i++) {
+            matrix_free(&nn->specs[i].recurrent);
+        }
+    }
+    recurrent_state_free(nn->recurrent, nn->count);
+    recurrent_deltas_free(nn->recurrentDeltas, nn->count);
+    free(nn->columns);
+    free(nn->columnDeltas);
+    free(nn->layers);
+    free(nn->weights);
+    free(nn->biases);
+    free(nn->activations);
+    free(nn->plans);
+    free(nn->specs);
+    nn->plans = NULL;
+    nn->specs = NULL;
+    nn->recurrent = NULL;
+    nn->recurrentDeltas = NULL;
+    nn->columns = NULL;
+    nn->columnDeltas = NULL;
+    nn->layers = NULL;
+    nn->weights = NULL;
+    nn->biases = NULL;
+    nn->activations = NULL;
+    nn->count = 0;
+}
+
+void Network_print(Network *nn, const char *name, bool showLayers) {
+    char buff[100];
+    printf("%s = [\n", name);
+    for (int i = 0; i < nn->count; i++) {
+        if (showLayers) {
+            snprintf(buff, sizeof(buff), "%s->layers[%d]", name, i);
+            matrix_print(&nn->layers[i], buff, 4, "%f");
+        }
+        snprintf(buff, sizeof(buff), "%s->weights[%d]", name, i);
+        matrix_print(&nn->weights[i], buff, 4, "%f");
+        snprintf(buff, sizeof(buff), "%s->biases[%d]", name, i);
+        matrix_print(&nn->biases[i], buff, 4, "%f");
+        if (Network_layer_type(nn, i) == LAYER_GRU) {
+            snprintf(buff, sizeof(buff), "%s->specs[%d].recurrent", name, i);
+            matrix_print(&nn->specs[i].recurrent, buff, 4, "%f");
+        }
+        if (nn->activations) {
+            snprintf(buff, sizeof(buff), "%s->activations[%d]", name, i);
+            print_activation(&nn->activations[i], buff, 4);
+        }
+    }
+    if (showLayers) {
+        snprintf(buff, sizeof(buff), "%s->layers[%d]", name, nn->count);
+        matrix_print(&nn->layers[nn->count], buff, 4, "%f");
+    }
+    printf("]\n");
+}
+
+void Network_rand(Network *nn, float low, float high) {
+    for (int i = 0; i < nn->count; i++) {
+        matrix_rand(&nn->weights[i], low, high);
+        matrix_rand(&nn->biases[i], low, high);
+        if (Network_layer_type(nn, i) == LAYER_GRU)
+            matrix_rand(&nn->specs[i].recurrent, low, high);
+    }
+}
+
+void Network_clear(Network *nn) {
+    for (int i = 0; i < nn->count; i++) {
+        matrix_clear(&nn->layers[i]);
+        matrix_clear(&nn->weights[i]);
+        matrix_clear(&nn->biases[i]);
+        if (Network_layer_type(nn, i) == LAYER_GRU)
+            matrix_clear(&nn->specs[i].recurrent);
+    }
+    matrix_clear(&nn->layers[nn->count]);
+}
+
+float Network_cost(Network *nn, Matrix *in, Matrix *out) {
+    ForwardContext ctx = Network_forward_context(nn);
+    return Network_cost_ctx(nn, &ctx, in, out);
+}
+
+float Network_Q_cost(Network *nn, Step *steps, int stepAmount, Matrix *Qtargets) {
+    ForwardContext ctx = Network_forward_context(nn);
+    return Network_Q_cost_ctx(nn, &ctx, steps, stepAmount, Qtargets);
+}
+
+float Network_cross_entropy_loss(Network *nn, Step *steps, int stepAmount) {
+    return Network_cross_entropy_loss_weighted(nn, steps, NULL, stepAmount);
+}
+
+// weights[i] scales the loss of steps[i] (returns or advantages), NULL uses steps[i].reward
+float Network_cross_entropy_loss_weighted(Network *nn, Step *steps, float *weights, int stepAmount) {
+    (void) nn;
+
+    float cost = 0.f;
+    for (int i = 0; i < stepAmount; i++) {
+        float prob = steps[i].output;
+        float weight = (weights ? weights[i] : steps[i].reward);
+        if (weight != 0 && prob > 0) {
+            cost += weight * -log(prob);
+        }
+    }
+    return cost;
+}
+
+void Network_forward(Network *nn) {
+    ForwardContext ctx = Network_forward_context(nn);
+    Network_forward_ctx(nn, &ctx);
+}
+
+// cost of nn over every row of in, recurrent layers start each evaluation from a cleared hidden state
+float network_diff_cost(Network *nn, Matrix *in, Matrix *out) {
+    ForwardContext ctx = Network_forward_context(nn);
+    ForwardContext_reset(&ctx);
+    return Network_cost_ctx(nn, &ctx, in, out);
+}
+
+// forward difference of the cost for every entry of param, written to the same entry of grad
+void network_diff_matrix(Network *nn, Matrix *param, Matrix *grad, float eps, float cost, Matrix *in, Matrix *out) {
+    for (int j = 0; j < param->rows; j++) {
+        for (int k = 0; k < param->cols; k++) {
+            float saved = MAT_AT(param, j, k);
+            MAT_AT(param, j, k) += eps;
+            float newCost = network_diff_cost(nn, in, out);
+            MAT_AT(grad, j, k) = (newCost - cost) / eps;
+            MAT_AT(param, j, k) = saved;
+        }
+    }
+}
+
+// numeric gradient of Network_cost, including the recurrent matrix of GRU layers
+// the rows of in run as one sequence from a cleared hidden state, so for recurrent layers this is the
+// full gradient through every row: compare it against backprop with a sequence context covering all rows
+void Network_diff(Network *nn, Network *g, float eps, Matrix *in, Matrix *out) {
+    if (in->rows != out->rows)
+        return;
+    Matrix in_row = matrix_row(in, 0);
+    if (!matrix_same(&NETWORK_IN(nn), &in_row))
+        return;
+    Matrix out_row = matrix_row(out, 0);
+    if (!matrix_same(&NETWORK_OUT(nn), &out_row))
+        return;
+    if (!Network_same(nn, g))
+        return;
+
+    float cost = network_diff_cost(nn, in, out);
+    for (int i = 0; i < nn->count; i++) {
+        network_diff_matrix(nn, &nn->weights[i], &g->weights[i], eps, cost, in, out);
+        network_diff_matrix(nn, &nn->biases[i], &g->biases[i], eps, cost, in, out);
+        if (Network_layer_type(nn, i) == LAYER_GRU && Network_layer_type(g, i) == LAYER_GRU)
+            network_diff_matrix(nn, &nn->specs[i].recurrent, &g->specs[i].recurrent, eps, cost, in, out);
+    }
+}
+
+void Network_policy_gradient_diff(Network *nn, Network *g, float eps, Step *steps, int stepAmount) {
+    if (!steps)
+        return;
+    if (!matrix_same(&NETWORK_IN(nn), &steps[0].state))
+        return;
+    if (!Network_same(nn, g))
+        return;
+
+    float saved;
+    float cost = Network_cross_entropy_loss(nn, steps, stepAmount);
+    for (int i = 0; i < nn->count; i++) {
+        Matrix *weights = &nn->weights[i];
+        for (int j = 0; j < weights->rows; j++) {
+            for (int k = 0; k < weights->cols; k++) {
+                saved = MAT_AT(weights, j, k);
+                MAT_AT(weights, j, k) += eps;
+                float newCost = Network_cross_entropy_loss(nn, steps, stepAmount);
+                MAT_AT(&g->weights[i], j, k) = (newCost - cost) / eps;
+                MAT_AT(weights, j, k) = saved;
+            }
+        }
+
+        Matrix *biases = &nn->biases[i];
+        for (int k = 0; k < biases->cols; k++) {
+            saved = MAT_AT(biases, 0, k);
+            MAT_AT(biases, 0, k) += eps;
+            float newCost = Network_cross_entropy_loss(nn, steps, stepAmount);
+            MAT_AT(&g->biases[i], 0, k) = (newCost - cost) / eps;
+            MAT_AT(biases, 0, k) = saved;
+        }
+    }
+}
+
+void Network_backprop(Network *nn, Network *g, Matrix *in, Matrix *out) {
+    ForwardContext fctx = Network_forward_context(nn);
+    BackwardContext bctx = Network_backward_context(g);
+    Network_backprop_ctx(nn, g, &fctx, &bctx, in, out);
+}
+
+void Network_Q_backprop(Network *nn, Network *g, Matrix *Qtargets, Step *steps, int *stepIndexes) {
+    ForwardContext fctx = Network_forward_context(nn);
+    BackwardContext bctx = Network_backward_context(g);
+    Network_Q_backprop_ctx(nn, g, &fctx, &bctx, Qtargets, steps, stepIndexes);
+}
+
+void calc_QTargets(Network *TargetNN, Matrix *QTargets, Step *steps, int *indexes) {
+    ForwardContext ctx = Network_forward_context(TargetNN);
+    calc_QTargets_ctx(TargetNN, &ctx, QTargets, steps, indexes);
+}
+
+void Network_policy_gradient_backprop(Network *nn, Network *g, Step *steps, int stepAmount) {
+    ForwardContext fctx = Network_forward_context(nn);
+    BackwardContext bctx = Network_backward_context(g);
+    Network_policy_gradient_backprop_ctx(nn, g, &fctx, &bctx, steps, stepAmount);
+}
+
+void Network_policy_gradient_backprop_weighted(Network *nn, Network *g, Step *steps, float *weights, int stepAmount) {
+    ForwardContext fctx = Network_forward_context(nn);
+    BackwardContext bctx = Network_backward_context(g);
+    Network_policy_gradient_backprop_weighted_ctx(nn, g, &fctx, &bctx, steps, weights, stepAmount);
+}
+
+void Network_scale(Network *nn, float factor) {
+    for (int i = 0; i < nn->count; i++) {
+        Matrix *curWeights = &nn->weights[i];
+        for (int j = 0; j < curWeights->rows; j++) {
+            for (int k = 0; k < curWeights->cols; k++) {
+                MAT_AT(curWeights, j, k) *= factor;
+            }
+        }
+
+        Matrix *curBiases = &nn->biases[i];
+        for (int k = 0; k < curBiases->cols; k++) {
+            MAT_AT(curBiases, 0, k) *= factor;
+        }
+
+        if (Network_layer_type(nn, i) == LAYER_GRU) {
+            Matrix *curRecurrent = &nn->specs[i].recurrent;
+            for (int j = 0; j < curRecurrent->rows; j++) {
+                for (int k = 0; k < curRecurrent->cols; k++) {
+                    MAT_AT(curRecurrent, j, k) *= factor;
+                }
+            }
+        }
+    }
+}
+
+void Network_gradient_descent(Network *nn, Network *g, float rate) {
+    if (!Network_same(nn, g))
+        return;
+
+    for (int i = 0; i < nn->count; i++) {
+        Matrix *curWeights = &nn->weights[i];
+        Matrix *curGradWeights = &g->weights[i];
+        for (int j = 0; j < curWeights->rows; j++) {
+            for (int k = 0; k < curWeights->cols; k++) {
+                MAT_AT(curWeights, j, k) -= rate * MAT_AT(curGradWeights, j, k);
+            }
+        }
+
+        Matrix *curBiases = &nn->biases[i];
+        Matrix *curGradBiases = &g->biases[i];
+        for (int k = 0; k < curBiases->cols; k++) {
+            MAT_AT(curBiases, 0, k) -= rate * MAT_AT(curGradBiases, 0, k);
+        }
+
+        if (Network_layer_type(nn, i) == LAYER_GRU) {
+            Matrix *curRecurrent = &nn->specs[i].recurrent;
+            Matrix *curGradRecurrent = &g->specs[i].recurrent;
+            for (int j = 0; j < curRecurrent->rows; j++) {
+                for (int k = 0; k < curRecurrent->cols; k++) {
+                    MAT_AT(curRecurrent, j, k) -= rate * MAT_AT(curGradRecurrent, j, k);
+                }
+            }
+        }
+    }
+}
+
+void Network_gradient_ascent(Network *nn, Network *g, float rate) {
+    if (!Network_same(nn, g))
+        return;
+
+    // this is in here just in case because i did copy paste the new part
+
+    // for (int i = 0; i < nn->count; i++) {
+    //     for (int j = 0; j < nn->weights[i]->rows; j++) {
+    //         for (int k = 0; k < nn->weights[i]->cols; k++) {
+    //             MAT_AT(nn->weights[i], j, k) += rate * MAT_AT(g->weights[i], j, k);
+    //         }
+    //     }
+
+    //     for (int k = 0; k < nn->biases[i]->cols; k++) {
+    //         MAT_AT(nn->biases[i], 0, k) += rate * MAT_AT(g->biases[i], 0, k);
+    //     }
+    // }
+
+    for (int i = 0; i < nn->count; i++) {
+        Matrix *curWeights = &nn->weights[i];
+        Matrix *curGradWeights = &g->weights[i];
+        for (int j = 0; j < curWeights->rows; j++) {
+            for (int k = 0; k < curWeights->cols; k++) {
+                MAT_AT(curWeights, j, k) += rate * MAT_AT(curGradWeights, j, k);
+            }
+        }
+
+        Matrix *curBiases = &nn->biases[i];
+        Matrix *curGradBiases = &g->biases[i];
+        for (int k = 0; k < curBiases->cols; k++) {
+            MAT_AT(curBiases, 0, k) += rate * MAT_AT(curGradBiases, 0, k);
+        }
+
+        if (Network_layer_type(nn, i) == LAYER_GRU) {
+            Matrix *curRecurrent = &nn->specs[i].recurrent;
+            Matrix *curGradRecurrent = &g->specs[i].recurrent;
+            for (int j = 0; j < curRecurrent->rows; j++) {
+                for (int k = 0; k < curRecurrent->cols; k++) {
+                    MAT_AT(curRecurrent, j, k) += rate * MAT_AT(curGradRecurrent, j, k);
+                }
+            }
+        }
+    }
+}
+
+// every row is its own stream, one step per forward call
+ForwardContext ForwardContext_new(Network *nn, int batch) {
+    return ForwardContext_sequence(nn, batch, 1);
+}
+
+// room for `steps` time steps of `streams` sequences per call, for truncated backprop through time
+ForwardContext ForwardContext_sequence(Network *nn, int streams, int steps) {
+    ForwardContext ctx = {0};
+    ctx.count = nn->count;
+    ctx.batch = streams * steps;
+    ctx.streams = streams;
+    ctx.layers = calloc(sizeof(*ctx.layers), nn->count + 1);
+    for (int i = 0; i <= nn->count; i++) {
+        ctx.layers[i] = matrix_new(ctx.batch, nn->layers[i].cols);
+    }
+    ctx.recurrent = recurrent_state_new(nn, streams, ctx.batch);
+    ctx.columns = network_columns_new(nn, ctx.batch);
+    return ctx;
+}
+
+void ForwardContext_free(ForwardContext *ctx) {
+    for (int i = 0; i <= ctx->count; i++) {
+        matrix_free(&ctx->layers[i]);
+    }
+    recurrent_state_free(ctx->recurrent, ctx->count);
+    free(ctx->layers);
+    free(ctx->columns);
+    ctx->layers = NULL;
+    ctx->recurrent = NULL;
+    ctx->columns = NULL;
+}
+
+// uses only the first `rows` rows of the batch, for the last partial chunk of a dataset
+void ForwardContext_set_rows(ForwardContext *ctx, int rows) {
+    if (rows > ctx->batch)
+        rows = ctx->batch;
+    for (int i = 0; i <= ctx->count; i++) {
+        ctx->layers[i].rows = rows;
+    }
+}
+
+// forgets the hidden state of every stream, for the start of new sequences
+void ForwardContext_reset(ForwardContext *ctx) {
+    if (!ctx->recurrent)
+        return;
+    for (int i = 0; i < ctx->count; i++) {
+        matrix_clear(&ctx->recurrent[i].hidden);
+    }
+}
+
+// forgets the hidden state of a single stream, for when its episode ends
+void ForwardContext_reset_stream(ForwardContext *ctx, int stream) {
+    if (!ctx->recurrent || stream < 0 || stream >= ctx->streams)
+        return;
+    for (int i = 0; i < ctx->count; i++) {
+        if (ctx->recurrent[i].hidden.data) {
+            Matrix row = matrix_row(&ctx->recurrent[i].hidden, stream);
+            matrix_clear(&row);
+        }
+    }
+}
+
+// context over the Network's own layers, keeps the single threaded api working
+// recurrent layers run one step per call with the Network's own hidden state
+// must not be freed
+ForwardContext Network_forward_context(Network *nn) {
+    ForwardContext ctx = {
+        .count = nn->count,
+        .batch = 1,
+        .streams = 1,
+        .layers = nn->layers,
+        .recurrent = nn->recurrent,
+        .columns = nn->columns,
+    };
+    return ctx;
+}
+
+BackwardContext BackwardContext_new(Network *nn, int batch) {
+    return BackwardContext_sequence(nn, batch, 1);
+}
+
+// must match the ForwardContext_sequence it is used with
+BackwardContext BackwardContext_sequence(Network *nn, int streams, int steps) {
+    BackwardContext ctx = {0};
+    ctx.count = nn->count;
+    ctx.batch = streams * steps;
+    ctx.deltas = calloc(sizeof(*ctx.deltas), nn->count + 1);
+    for (int i = 0; i <= nn->count; i++) {
+        ctx.deltas[i] = matrix_new(ctx.batch, nn->layers[i].cols);
+    }
+    ctx.recurrent = recurrent_deltas_new(nn, streams, ctx.batch);
+    ctx.columns = network_columns_new(nn, ctx.batch);
+    return ctx;
+}
+
+void BackwardContext_free(BackwardContext *ctx) {
+    for (int i = 0; i <= ctx->count; i++) {
+        matrix_free(&ctx->deltas[i]);
+    }
+    recurrent_deltas_free(ctx->recurrent, ctx->count);
+    free(ctx->deltas);
+    free(ctx->columns);
+    ctx->deltas = NULL;
+    ctx->recurrent = NULL;
+    ctx->columns = NULL;
+}
+
+void BackwardContext_set_rows(BackwardContext *ctx, int rows) {
+    if (rows > ctx->batch)
+        rows = ctx->batch;
+    for (int i = 0; i <= ctx->count; i++) {
+        ctx->deltas[i].rows = rows;
+    }
+}
+
+// context over the gradient Network's layers, which is where the old api kept its deltas
+// must not be freed
+BackwardContext Network_backward_context(Network *g) {
+    BackwardContext ctx = {
+        .count = g->count,
+        .batch = 1,
+        .deltas = g->layers,
+        .recurrent = g->recurrentDeltas,
+        .columns = g->columnDeltas,
+    };
+    return ctx;
+}
+
+// one row per output position of every image in `in`, holding the window under it ordered ky, kx, channel
+void conv_im2col(Layer *spec, Matrix *in, Matrix *columns) {
+    int channels = spec->channels;
+    int kernel = spec->kernel;
+    for (int n = 0; n < in->rows; n++) {
+        float *image = &MAT_AT(in, n, 0);
+        for (int oy = 0; oy < spec->outHeight; oy++) {
+            for (int ox = 0; ox < spec->outWidth; ox++) {
+                float *dest = &MAT_AT(columns, (n * spec->outHeight + oy) * spec->outWidth + ox, 0);
+                for (int ky = 0; ky < kernel; ky++) {
+                    int iy = oy * spec->stride - spec->padding + ky;
+                    for (int kx = 0; kx < kernel; kx++) {
+                        int ix = ox * spec->stride - spec->padding + kx;
+                        float *window = dest + (ky * kernel + kx) * channels;
+                        if (iy < 0 || iy >= spec->height || ix < 0 || ix >= spec->width) {
+                            memset(window, 0, sizeof(*window) * channels);
+                        } else {
+                            memcpy(window, image + (iy * spec->width + ix) * channels, sizeof(*window) * channels);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// inverse of conv_im2col, sums every window back into the image positions it was copied from
+void conv_col2im(Layer *spec, Matrix *columns, Matrix *dest) {
+    int channels = spec->channels;
+    int kernel = spec->kernel;
+    matrix_clear(dest);
+    for (int n = 0; n < dest->rows; n++) {
+        float *image = &MAT_AT(dest, n, 0);
+        for (int oy = 0; oy < spec->outHeight; oy++) {
+            for (int ox = 0; ox < spec->outWidth; ox++) {
+                float *src = &MAT_AT(columns, (n * spec->outHeight + oy) * spec->outWidth + ox, 0);
+                for (int ky = 0; ky < kernel; ky++) {
+                    int iy = oy * spec->stride - spec->padding + ky;
+                    if (iy < 0 || iy >= spec->height)
+                        continue;
+                    for (int kx = 0; kx < kernel; kx++) {
+                        int ix = ox * spec->stride - spec->padding + kx;
+                        if (ix < 0 || ix >= spec->width)
+                            continue;
+                        float *window = src + (ky * kernel + kx) * channels;
+                        float *pixel = image + (iy * spec->width + ix) * channels;
+                        for (int c = 0; c < channels; c++) {
+                            pixel[c] += window[c];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// view of a columns workspace for `rows` images
+Matrix conv_columns(Layer *spec, float *workspace, int rows) {
+    Matrix m = {0};
+    m.rows = rows * spec->outHeight * spec->outWidth;
+    m.cols = spec->kernel * spec->kernel * spec->channels;
+    m.stride = m.cols;
+    m.data = workspace;
+    return m;
+}
+
+// the whole batch is one GEMM: (positions x window) * (window x filters) lands directly in the
+// channels last layout of the output
+void conv_forward(Network *nn, int layer, ForwardContext *ctx) {
+    Layer *spec = &nn->specs[layer];
+    Matrix *in = &ctx->layers[layer];
+    Matrix *out = &ctx->layers[layer + 1];
+    Matrix columns = conv_columns(spec, ctx->columns, in->rows);
+    conv_im2col(spec, in, &columns);
+    Matrix positions = matrix_reshape(out, columns.rows, spec->filters);
+    matrix_dot_plan(&positions, &columns, &nn->weights[layer], Network_plan(nn, layer, in->rows));
+    matrix_add_row(&positions, &nn->biases[layer]);
+    if (nn->activations)
+        matrix_apply_activation(out, &nn->activations[layer]);
+}
+
+// delta already holds dLoss/d(pre activation output)
+// the im2col of the input is rebuilt instead of kept from the forward pass
+void conv_backward(Network *nn, Network *g, int layer, ForwardContext *fctx, BackwardContext *bctx, bool inputDelta) {
+    Layer *spec = &nn->specs[layer];
+    Matrix *in = &fctx->layers[layer];
+    Matrix columns = conv_columns(spec, fctx->columns, in->rows);
+    conv_im2col(spec, in, &columns);
+    Matrix positions = matrix_reshape(&bctx->deltas[layer + 1], columns.rows, spec->filters);
+
+    for (int i = 0; i < positions.rows; i++) {
+        for (int j = 0; j < positions.cols; j++) {
+            MAT_AT(&g->biases[layer], 0, j) += MAT_AT(&positions, i, j);
+        }
+    }
+    matrix_dot_at(&g->weights[layer], &columns, &positions);
+    if (inputDelta) {
+        Matrix columnDeltas = conv_columns(spec, bctx->columns, in->rows);
+        matrix_dot_bt(&columnDeltas, &positions, &nn->weights[layer]);
+        conv_col2im(spec, &columnDeltas, &bctx->deltas[layer]);
+    }
+}
+
+void pool_forward(Network *nn, int layer, ForwardContext *ctx) {
+    Layer *spec = &nn->specs[layer];
+    Matrix *in = &ctx->layers[layer];
+    Matrix *out = &ctx->layers[layer + 1];
+    int channels = spec->channels;
+    bool max = (spec->type == LAYER_MAXPOOL);
+    float scale = 1.f / (spec->kernel * spec->kernel);
+    for (int n = 0; n < in->rows; n++) {
+        float *image = &MAT_AT(in, n, 0);
+        float *pooled = &MAT_AT(out, n, 0);
+        for (int oy = 0; oy < spec->outHeight; oy++) {
+            for (int ox = 0; ox < spec->outWidth; ox++) {
+                float *dest = pooled + (oy * spec->outWidth + ox) * channels;
+                float *first = image + (oy * spec->stride * spec->width + ox * spec->stride) * channels;
+                memcpy(dest, first, sizeof(*dest) * channels);
+                for (int ky = 0; ky < spec->kernel; ky++) {
+                    for (int kx = 0; kx < spec->kernel; kx++) {
+                        if (ky == 0 && kx == 0)
+                            continue;
+                        float *pixel = first + (ky * spec->width + kx) * channels;
+                        for (int c = 0; c < channels; c++) {
+                            if (max) {
+                                dest[c] = (pixel[c] > dest[c] ? pixel[c] : dest[c]);
+                            } else {
+                                dest[c] += pixel[c];
+                            }
+                        }
+                    }
+                }
+                if (!max) {
+                    for (int c = 0; c < channels; c++) {
+                        dest[c] *= scale;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// max pooling sends each delta to the first input of its window that equals the pooled value,
+// which is the one the forward pass picked, so no argmax has to be stored
+void pool_backward(Network *nn, int layer, ForwardContext *fctx, BackwardContext *bctx) {
+    Layer *spec = &nn->specs[layer];
+    Matrix *in = &fctx->layers[layer];
+    Matrix *out = &fctx->layers[layer + 1];
+    Matrix *delta = &bctx->deltas[layer + 1];
+    Matrix *dest = &bctx->deltas[layer];
+    int channels = spec->channels;
+    bool max = (spec->type == LAYER_MAXPOOL);
+    float scale = 1.f / (spec->kernel * spec->kernel);
+    matrix_clear(dest);
+    for (int n = 0; n < in->rows; n++) {
+        for (int oy = 0; oy < spec->outHeight; oy++) {
+            for (int ox = 0; ox < spec->outWidth; ox++) {
+                int pos = (oy * spec->outWidth + ox) * channels;
+                int first = (oy * spec->stride * spec->width + ox * spec->stride) * channels;
+                for (int c = 0; c < channels; c++) {
+                    float d = MAT_AT(delta, n, pos + c);
+                    bool routed = false;
+                    for (int ky = 0; ky < spec->kernel && !routed; ky++) {
+                        for (int kx = 0; kx < spec->kernel && !routed; kx++) {
+                            int at = first + (ky * spec->width + kx) * channels + c;
+                            if (!max) {
+                                MAT_AT(dest, n, at) += d * scale;
+                            } else if (MAT_AT(in, n, at) == MAT_AT(out, n, pos + c)) {
+                                MAT_AT(dest, n, at) += d;
+                                routed = true;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// one LAYER_GRU over every step in ctx
+// the input side of all three gates for every step is a single GEMM, then each step is one more
+// GEMM of the hidden state with the fused recurrent weights
+void gru_forward(Network *nn, int layer, ForwardContext *ctx) {
+    Matrix *in = &ctx->layers[layer];
+    Matrix *out = &ctx->layers[layer + 1];
+    RecurrentState *rs = &ctx->recurrent[layer];
+    int units = out->cols;
+    int rows = out->rows;
+    int streams = (ctx->streams < rows ? ctx->streams : rows);
+
+    Matrix gates = matrix_rows(&rs->gates, 0, rows);
+    Matrix inputGates = matrix_cols(&gates, 0, 3 * units);
+    matrix_dot_plan(&inputGates, in, &nn->weights[layer], Network_plan(nn, layer, rows));
+    matrix_add_row(&inputGates, &nn->biases[layer]);
+    matrix_copy(&rs->initial, &rs->hidden);
+
+    for (int start = 0; start < rows; start += streams) {
+        int count = (rows - start < streams ? rows - start : streams);
+        Matrix hidden = matrix_rows(&rs->hidden, 0, count);
+        Matrix recur = matrix_rows(&rs->recur, 0, count);
+        matrix_dot(&recur, &hidden, &nn->specs[layer].recurrent);
+
+        for (int i = 0; i < count; i++) {
+            float *g = &MAT_AT(&gates, start + i, 0);
+            float *c = &MAT_AT(&recur, i, 0);
+            float *h = &MAT_AT(&hidden, i, 0);
+            float *o = &MAT_AT(out, start + i, 0);
+            for (int j = 0; j < units; j++) {
+                float z = sigmoidf(g[j] + c[j]);
+                float r = sigmoidf(g[units + j] + c[units + j]);
+                float n = tanhf(g[2 * units + j] + r * c[2 * units + j]);
+                g[j] = z;
+                g[units + j] = r;
+                g[2 * units + j] = n;
+                g[3 * units + j] = c[2 * units + j];
+                o[j] = (1 - z) * n + z * h[j];
+            }
+            memcpy(h, o, sizeof(*h) * units);
+        }
+    }
+}
+
+// runs every row of CONTEXT_IN(ctx) through nn
+// nn is only read, so any number of threads can share it as long as each has its own ctx
+// recurrent layers continue from the hidden state the last call left in ctx
+void Network_forward_ctx(Network *nn, ForwardContext *ctx) {
+    for (int i = 0; i < nn->count; i++) {
+        Matrix *dest = &ctx->layers[i + 1];
+        switch (Network_layer_type(nn, i)) {
+            case LAYER_DENSE:
+                break;
+            case LAYER_GRU:
+                gru_forward(nn, i, ctx);
+                continue;
+            case LAYER_CONV2D:
+                conv_forward(nn, i, ctx);
+                continue;
+            case LAYER_MAXPOOL:
+            case LAYER_AVGPOOL:
+                pool_forward(nn, i, ctx);
+                continue;
+        }
+        matrix_dot_plan(dest, &ctx->layers[i], &nn->weights[i], Network_plan(nn, i, dest->rows));
+        matrix_add_row(dest, &nn->biases[i]);
+        if (nn->activations)
+            matrix_apply_activation(dest, &nn->activations[i]);
+    }
+}
+
+// Lane evaluation runs tiny dense networks on NETWORK_LANES samples at once with every activation
+// stored as [unit][lane], so each multiply add covers a whole register of samples and a layer never
+// needs edge handling or a GEMM plan. Weights are broadcast straight out of nn.
+
+// expf of n * NETWORK_LANES floats in place, a Cephes style polynomial that vectorizes
+// (libm's expf does not without -ffast-math), relative error below 3e-7
+ML_LANES_TARGET
+void lanes_exp(float *v, int n) {
+    for (int i = 0; i < n; i++) {
+        float *x = &v[i * NETWORK_LANES];
+        int32_t bits[NETWORK_LANES];
+        for (int l = 0; l < NETWORK_LANES; l++) {
+            float t = x[l];
+            t = (t < -87.f ? -87.f : t);
+            t = (t > 88.f ? 88.f : t);
+            // round to nearest by pushing the fraction out of the mantissa
+            float k = (t * 1.44269504f + 12582912.f) - 12582912.f;
+            float r = t - k * 0.693359375f + k * 2.12194440e-4f;
+            float p = 1.9875691500e-4f;
+            p = p * r + 1.3981999507e-3f;
+            p = p * r + 8.3334519073e-3f;
+            p = p * r + 4.1665795894e-2f;
+            p = p * r + 1.6666665459e-1f;
+            p = p * r + 5.0000001201e-1f;
+            x[l] = p * r * r + r + 1.f;
+            bits[l] = ((int32_t) k + 127) << 23;
+        }
+        float scale[NETWORK_LANES];
+        memcpy(scale, bits, sizeof(scale));
+        for (int l = 0; l < NETWORK_LANES; l++) {
+            x[l] *= scale[l];
+        }
+    }
+}
+
+// the Activation of one layer over units x NETWORK_LANES values
+ML_LANES_TARGET
+void lanes_activate(float *v, int units, Activation *a) {
+    int n = units * NETWORK_LANES;
+    switch (a->type) {
+        case SIGMOID:
+            for (int i = 0; i < n; i++) {
+                v[i] = -v[i];
+            }
+            lanes_exp(v, units);
+            for (int i = 0; i < n; i++) {
+                v[i] = 1.f / (1.f + v[i]);
+            }
+            break;
+        case TANH:
+            // 1 - 2 / (e^2x + 1), saturates cleanly where e^2x overflows the clamp
+            for (int i = 0; i < n; i++) {
+                v[i] *= 2.f;
+            }
+            lanes_exp(v, units);
+            for (int i = 0; i < n; i++) {
+                v[i] = 1.f - 2.f / (v[i] + 1.f);
+            }
+            break;
+        case RELU:
+            for (int i = 0; i < n; i++) {
+                v[i] = (v[i] > 0.f ? v[i] : 0.f);
+            }
+            break;
+        case LEAKYRELU:
+            for (int i = 0; i < n; i++) {
+                v[i] = (v[i] > 0.f ? v[i] : 0.01f * v[i]);
+            }
+            break;
+        case SOFTMAX: {
+            // every lane is its own sample, normalize down the units
+            float most[NETWORK_LANES], sum[NETWORK_LANES];
+            memcpy(most, v, sizeof(most));
+            for (int j = 1; j < units; j++) {
+                for (int l = 0; l < NETWORK_LANES; l++) {
+                    float x = v[j * NETWORK_LANES + l];
+                    most[l] = (x > most[l] ? x : most[l]);
+                }
+            }
+            for (int j = 0; j < units; j++) {
+                for (int l = 0; l < NETWORK_LANES; l++) {
+                    v[j * NETWORK_LANES + l] -= most[l];
+                }
+            }
+            lanes_exp(v, units);
+            memset(sum, 0, sizeof(sum));
+            for (int j = 0; j < units; j++) {
+                for (int l = 0; l < NETWORK_LANES; l++) {
+                    sum[l] += v[j * NETWORK_LANES + l];
+                }
+            }
+            for (int j = 0; j < units; j++) {
+                for (int l = 0; l < NETWORK_LANES; l++) {
+                    v[j * NETWORK_LANES + l] /= sum[l];
+                }
+            }
+            break;
+        }
+        default:
+            if (a->activationFunc) {
+                for (int i = 0; i < n; i++) {
+                    v[i] = a->activationFunc(v[i]);
+                }
+            }
+            break;
+    }
+}
+
+// out[j][lane] = bias[j] + sum over k of in[k][lane] * weights[k][j], four units per pass so four
+// accumulators stay in registers while the inputs stream through
+ML_LANES_TARGET
+void lanes_dense(float *out, float *in, Matrix *weights, Matrix *biases) {
+    int rows = weights->rows;
+    int cols = weights->cols;
+    int j = 0;
+    for (; j + 4 <= cols; j += 4) {
+        float a0[NETWORK_LANES], a1[NETWORK_LANES], a2[NETWORK_LANES], a3[NETWORK_LANES];
+        for (int l = 0; l < NETWORK_LANES; l++) {
+            a0[l] = MAT_AT(biases, 0, j);
+            a1[l] = MAT_AT(biases, 0, j + 1);
+            a2[l] = MAT_AT(biases, 0, j + 2);
+            a3[l] = MAT_AT(biases, 0, j + 3);
+        }
+        for (int k = 0; k < rows; k++) {
+            float *x = &in[k * NETWORK_LANES];
+            float *w = &MAT_AT(weights, k, j);
+            float w0 = w[0], w1 = w[1], w2 = w[2], w3 = w[3];
+            for (int l = 0; l < NETWORK_LANES; l++) {
+                a0[l] += w0 * x[l];
+                a1[l] += w1 * x[l];
+                a2[l] += w2 * x[l];
+                a3[l] += w3 * x[l];
+            }
+        }
+        memcpy(&out[j * NETWORK_LANES], a0, sizeof(a0));
+        memcpy(&out[(j + 1) * NETWORK_LANES], a1, sizeof(a1));
+        memcpy(&out[(j + 2) * NETWORK_LANES], a2, sizeof(a2));
+        memcpy(&out[(j + 3) * NETWORK_LANES], a3, sizeof(a3));
+    }
+    for (; j < cols; j++) {
+        float acc[NETWORK_LANES];
+        for (int l = 0; l < NETWORK_LANES; l++) {
+            acc[l] = MAT_AT(biases, 0, j);
+        }
+        for (int k = 0; k < rows; k++) {
+            float *x = &in[k * NETWORK_LANES];
+            float w = MAT_AT(weights, k, j);
+            for (int l = 0; l < NETWORK_LANES; l++) {
+                acc[l] += w * x[l];
+            }
+        }
+        memcpy(&out[j * NETWORK_LANES], acc, sizeof(acc));
+    }
+}
+
+// runs one group through every layer, buffers holds two LANES_MAX_WIDTH x NETWORK_LANES slots
+// and the input is expected in the first, returns the slot the output ended up in
+float *lanes_forward_group(Network *nn, float *buffers) {
+    float *in = buffers;
+    float *out = buffers + LANES_MAX_WIDTH * NETWORK_LANES;
+    for (int i = 0; i < nn->count; i++) {
+        lanes_dense(out, in, &nn->weights[i], &nn->biases[i]);
+        if (nn->activations)
+            lanes_activate(out, nn->weights[i].cols, &nn->activations[i]);
+        float *temp = in;
+        in = out;
+        out = temp;
+    }
+    return in;
+}
+
+// whether nn is small enough for lane evaluation: dense layers of at most LANES_MAX_WIDTH units
+bool Network_lanes_fit(Network *nn) {
+    for (int i = 0; i <= nn->count; i++) {
+        if (nn->layers[i].cols > LANES_MAX_WIDTH)
+            return false;
+    }
+    for (int i = 0; i < nn->count; i++) {
+        if (Network_layer_type(nn, i) != LAYER_DENSE)
+            return false;
+    }
+    return true;
+}
+
+// same result as Network_forward_ctx for every row of in (rows x inputs) into out (rows x outputs),
+// NETWORK_LANES rows at a time; nn is only read and the workspace is on the stack, so any number
+// of threads can call this on one Network
+void Network_forward_lanes(Network *nn, Matrix *in, Matrix *out) {
+    if (!Network_lanes_fit(nn) || in->cols != NETWORK_IN(nn).cols || out->cols != NETWORK_OUT(nn).cols ||
+        in->rows != out->rows) {
+        fprintf(stderr, "Network does not fit lane evaluation\n");
+        return;
+    }
+    float buffers[2 * LANES_MAX_WIDTH * NETWORK_LANES];
+    int inputs = in->cols;
+    int outputs = out->cols;
+    for (int row = 0; row < in->rows; row += NETWORK_LANES) {
+        int lanes = (in->rows - row < NETWORK_LANES ? in->rows - row : NETWORK_LANES);
+        // transpose into [input][lane], idle lanes of the last group compute on zeros
+        if (lanes < NETWORK_LANES)
+            memset(buffers, 0, sizeof(float) * inputs * NETWORK_LANES);
+        for (int l = 0; l < lanes; l++) {
+            for (int k = 0; k < inputs; k++) {
+                buffers[k * NETWORK_LANES + l] = MAT_AT(in, row + l, k);
+            }
+        }
+        float *result = lanes_forward_group(nn, buffers);
+        for (int l = 0; l < lanes; l++) {
+            for (int j = 0; j < outputs; j++) {
+                MAT_AT(out, row + l, j) = result[j * NETWORK_LANES + l];
+            }
+        }
+    }
+}
+
+// Network_forward_lanes for callers that already keep their states as structure of arrays:
+// in is inputs x samples and out is outputs x samples, column s is sample s
+void Network_forward_soa(Network *nn, Matrix *in, Matrix *out) {
+    if (!Network_lanes_fit(nn) || in->rows != NETWORK_IN(nn).cols || out->rows != NETWORK_OUT(nn).cols ||
+        in->cols != out->cols) {
+        fprintf(stderr, "Network does not fit lane evaluation\n");
+        return;
+    }
+    float buffers[2 * LANES_MAX_WIDTH * NETWORK_LANES];
+    int inputs = in->rows;
+    int outputs = out->rows;
+    for (int col = 0; col < in->cols; col += NETWORK_LANES) {
+        int lanes = (in->cols - col < NETWORK_LANES ? in->cols - col : NETWORK_LANES);
+        if (lanes < NETWORK_LANES)
+            memset(buffers, 0, sizeof(float) * inputs * NETWORK_LANES);
+        for (int k = 0; k < inputs; k++) {
+            memcpy(&buffers[k * NETWORK_LANES], &MAT_AT(in, k, col), sizeof(float) * lanes);
+        }
+        float *result = lanes_forward_group(nn, buffers);
+        for (int j = 0; j < outputs; j++) {
+            memcpy(&MAT_AT(out, j, col), &result[j * NETWORK_LANES], sizeof(float) * lanes);
+        }
+    }
+}
+
+// backprop through time over the steps of the last forward call, truncated at its first step
+// the gate deltas of all steps are kept so the weight gradients and the deltas of the layer
+// below are one GEMM each, only the recurrent part runs step by step
+void gru_backward(Network *nn, Network *g, int layer, ForwardContext *fctx, BackwardContext *bctx, bool inputDelta) {
+    Matrix *in = &fctx->layers[layer];
+    Matrix *out = &fctx->layers[layer + 1];
+    Matrix *delta = &bctx->deltas[layer + 1];
+    RecurrentState *rs = &fctx->recurrent[layer];
+    RecurrentDeltas *rd = &bctx->recurrent[layer];
+    Matrix *recurrent = &nn->specs[layer].recurrent;
+    int units = out->cols;
+    int rows = out->rows;
+    int streams = (fctx->streams < rows ? fctx->streams : rows);
+
+    Matrix gates = matrix_rows(&rs->gates, 0, rows);
+    Matrix gateDeltas = matrix_rows(&rd->gates, 0, rows);
+    Matrix inputDeltas = matrix_cols(&gateDeltas, 0, 3 * units);
+    Matrix recurDeltas = matrix_cols(&gateDeltas, 3 * units, 3 * units);
+    matrix_clear(&rd->carry);
+
+    for (int start = (rows - 1) / streams * streams; start >= 0; start -= streams) {
+        int count = (rows - start < streams ? rows - start : streams);
+        for (int i = 0; i < count; i++) {
+            int row = start + i;
+            float *prev = (row >= streams ? &MAT_AT(out, row - streams, 0) : &MAT_AT(&rs->initial, i, 0));
+            float *gt = &MAT_AT(&gates, row, 0);
+            float *dh = &MAT_AT(delta, row, 0);
+            float *carry = &MAT_AT(&rd->carry, i, 0);
+            float *da = &MAT_AT(&inputDeltas, row, 0);
+            float *dc = &MAT_AT(&recurDeltas, row, 0);
+            for (int j = 0; j < units; j++) {
+                float z = gt[j];
+                float r = gt[units + j];
+                float n = gt[2 * units + j];
+                float d = dh[j] + carry[j];
+                float dz = d * (prev[j] - n) * z * (1 - z);
+                float dn = d * (1 - z) * (1 - n * n);
+                float dr = dn * gt[3 * units + j] * r * (1 - r);
+                da[j] = dc[j] = dz;
+                da[units + j] = dc[units + j] = dr;
+                da[2 * units + j] = dn;
+                dc[2 * units + j] = dn * r;
+                carry[j] = d * z;
+            }
+        }
+        Matrix stepDeltas = matrix_rows(&recurDeltas, start, count);
+        Matrix back = matrix_rows(&rd->recur, 0, count);
+        Matrix carry = matrix_rows(&rd->carry, 0, count);
+        matrix_dot_bt(&back, &stepDeltas, recurrent);
+        matrix_sum(&carry, &back);
+    }
+
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < 3 * units; j++) {
+            MAT_AT(&g->biases[layer], 0, j) += MAT_AT(&inputDeltas, i, j);
+        }
+    }
+    matrix_dot_at(&g->weights[layer], in, &inputDeltas);
+
+    // the hidden state before each step is the initial state for the first one, the previous output after that
+    Matrix firstInitial = matrix_rows(&rs->initial, 0, streams);
+    Matrix firstDeltas = matrix_rows(&recurDeltas, 0, streams);
+    matrix_dot_at(&g->specs[layer].recurrent, &firstInitial, &firstDeltas);
+    if (rows > streams) {
+        Matrix prevOut = matrix_rows(out, 0, rows - streams);
+        Matrix restDeltas = matrix_rows(&recurDeltas, streams, rows - streams);
+        matrix_dot_at(&g->specs[layer].recurrent, &prevOut, &restDeltas);
+    }
+
+    if (inputDelta)
+        matrix_dot_bt(&bctx->deltas[layer], &inputDeltas, &nn->weights[layer]);
+}
+
+// inputDelta also fills bctx->deltas[0], for when nn is a segment of a bigger Network
+void network_backward(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx, bool inputDelta) {
+    // l = current layer
+    // j = current "node"
+    for (int l = nn->count; l > 0; l--) {
+        LayerType type = Network_layer_type(nn, l - 1);
+        if (type == LAYER_GRU) {
+            gru_backward(nn, g, l - 1, fctx, bctx, l > 1 || inputDelta);
+            continue;
+        }
+        if (type == LAYER_MAXPOOL || type == LAYER_AVGPOOL) {
+            if (l > 1 || inputDelta)
+                pool_backward(nn, l - 1, fctx, bctx);
+            continue;
+        }
+        Matrix *delta = &bctx->deltas[l];
+        Matrix *output = &fctx->layers[l];
+        if (nn->activations && nn->activations[l - 1].activationFunc) {
+            float (*derivativeFunc)(float) = getActDerivative(nn->activations[l - 1].type);
+            if (derivativeFunc) {
+                for (int i = 0; i < delta->rows; i++) {
+                    for (int j = 0; j < delta->cols; j++) {
+                        MAT_AT(delta, i, j) *= derivativeFunc(MAT_AT(output, i, j));
+                    }
+                }
+            }
+        }
+        if (type == LAYER_CONV2D) {
+            conv_backward(nn, g, l - 1, fctx, bctx, l > 1 || inputDelta);
+            continue;
+        }
+
+        for (int i = 0; i < delta->rows; i++) {
+            for (int j = 0; j < delta->cols; j++) {
+                MAT_AT(&g->biases[l - 1], 0, j) += MAT_AT(delta, i, j);
+            }
+        }
+        matrix_dot_at(&g->weights[l - 1], &fctx->layers[l - 1], delta);
+        if (l > 1 || inputDelta)
+            matrix_dot_bt(&bctx->deltas[l - 1], delta, &nn->weights[l - 1]);
+    }
+}
+
+// accumulates the gradients of the batch last run through fctx into g
+// bctx->deltas[count] must hold dLoss/dOutput for every row, the other deltas are overwritten
+void Network_backward_ctx(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx) {
+    network_backward(nn, g, fctx, bctx, false);
+}
+
+// mean squared error over every row of in/out, evaluated ctx->batch rows at a time
+float Network_cost_ctx(Network *nn, ForwardContext *ctx, Matrix *in, Matrix *out) {
+    if (ctx->batch <= 0)
+        return -1.f;
+    if (CONTEXT_IN(ctx).cols != in->cols)
+        return -1.f;
+    if (CONTEXT_OUT(ctx).cols != out->cols)
+        return -1.f;
+
+    float result = 0.f;
+    for (int start = 0; start < in->rows; start += ctx->batch) {
+        int rows = (in->rows - start < ctx->batch ? in->rows - start : ctx->batch);
+        ForwardContext_set_rows(ctx, rows);
+        Matrix in_rows = matrix_rows(in, start, rows);
+        matrix_copy(&CONTEXT_IN(ctx), &in_rows);
+        Network_forward_ctx(nn, ctx);
+
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < out->cols; j++) {
+                float d = MAT_AT(&CONTEXT_OUT(ctx), i, j) - MAT_AT(out, start + i, j);
+                result += d * d;
+            }
+        }
+    }
+
+    return result / in->rows;
+}
+
+float Network_Q_cost_ctx(Network *nn, ForwardContext *ctx, Step *steps, int stepAmount, Matrix *Qtargets) {
+    if (!stepAmount)
+        return 0;
+    if (stepAmount != Qtargets->rows)
+        return -1.f;
+    if (ctx->batch <= 0)
+        return -1.f;
+    if (CONTEXT_IN(ctx).cols != steps[0].state.cols)
+        return -1.f;
+
+    float result = 0.f;
+    for (int start = 0; start < stepAmount; start += ctx->batch) {
+        int rows = (stepAmount - start < ctx->batch ? stepAmount - start : ctx->batch);
+        ForwardContext_set_rows(ctx, rows);
+        for (int i = 0; i < rows; i++) {
+            Matrix in_row = matrix_row(&CONTEXT_IN(ctx), i);
+            matrix_copy(&in_row, &steps[start + i].state);
+        }
+        Network_forward_ctx(nn, ctx);
+
+        for (int i = 0; i < rows; i++) {
+            float d = MAT_AT(&CONTEXT_OUT(ctx), i, steps[start + i].action) - MAT_AT(Qtargets, start + i, 0);
+            result += d * d;
+        }
+    }
+
+    return result / stepAmount;
+}
+
+void Network_backprop_ctx(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx, Matrix *in, Matrix *out) {
+    if (fctx->batch <= 0)
+        return;
+    if (in->rows != out->rows)
+        return;
+    if (CONTEXT_IN(fctx).cols != in->cols)
+        return;
+    if (CONTEXT_OUT(fctx).cols != out->cols)
+        return;
+    if (!Network_same(nn, g))
+        return;
+    int n = in->rows; // amount of samples
+
+    Network_clear(g);
+
+    for (int start = 0; start < n; start += fctx->batch) {
+        int rows = (n - start < fctx->batch ? n - start : fctx->batch);
+        ForwardContext_set_rows(fctx, rows);
+        BackwardContext_set_rows(bctx, rows);
+        Matrix in_rows = matrix_rows(in, start, rows);
+        matrix_copy(&CONTEXT_IN(fctx), &in_rows);
+        Network_forward_ctx(nn, fctx);
+
+        Matrix *deltaOut = &bctx->deltas[nn->count];
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < out->cols; j++) {
+                MAT_AT(deltaOut, i, j) = 2 * (MAT_AT(&CONTEXT_OUT(fctx), i, j) - MAT_AT(out, start + i, j));
+            }
+        }
+        Network_backward_ctx(nn, g, fctx, bctx);
+    }
+
+    Network_scale(g, 1.f / n);
+}
+
+void Network_Q_backprop_ctx(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx, Matrix *Qtargets, Step *steps, int *stepIndexes) {
+    if (fctx->batch <= 0)
+        return;
+    if (!Network_same(nn, g))
+        return;
+    int n = Qtargets->rows; // amount of samples
+
+    Network_clear(g);
+
+    for (int start = 0; start < n; start += fctx->batch) {
+        int rows = (n - start < fctx->batch ? n - start : fctx->batch);
+        ForwardContext_set_rows(fctx, rows);
+        BackwardContext_set_rows(bctx, rows);
+        for (int i = 0; i < rows; i++) {
+            Matrix in_row = matrix_row(&CONTEXT_IN(fctx), i);
+            matrix_copy(&in_row, &steps[stepIndexes[start + i]].state);
+        }
+        Network_forward_ctx(nn, fctx);
+
+        Matrix *deltaOut = &bctx->deltas[nn->count];
+        for (int i = 0; i < rows; i++) {
+            int action = steps[stepIndexes[start + i]].action;
+            for (int j = 0; j < deltaOut->cols; j++) {
+                if (action == j) {
+                    MAT_AT(deltaOut, i, j) = 2 * (MAT_AT(&CONTEXT_OUT(fctx), i, j) - MAT_AT(Qtargets, start + i, 0));
+                } else {
+                    MAT_AT(deltaOut, i, j) = 0;
+                }
+            }
+        }
+        Network_backward_ctx(nn, g, fctx, bctx);
+    }
+
+    Network_scale(g, 1.f / n);
+}
+
+void Network_policy_gradient_backprop_ctx(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx, Step *steps, int stepAmount) {
+    Network_policy_gradient_backprop_weighted_ctx(nn, g, fctx, bctx, steps, NULL, stepAmount);
+}
+
+// weights[i] scales the gradient of steps[i], pass Trajectory returns or advantages
+// NULL weights uses steps[i].reward
+void Network_policy_gradient_backprop_weighted_ctx(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx, Step *steps, float *weights, int stepAmount) {
+    if (!steps)
+        return;
+    if (fctx->batch <= 0)
+        return;
+    if (CONTEXT_IN(fctx).cols != steps[0].state.cols)
+        return;
+    if (!Network_same(nn, g))
+        return;
+    int n = stepAmount; // amount of steps
+
+    Network_clear(g);
+
+    for (int start = 0; start < n; start += fctx->batch) {
+        int rows = (n - start < fctx->batch ? n - start : fctx->batch);
+        ForwardContext_set_rows(fctx, rows);
+        BackwardContext_set_rows(bctx, rows);
+        for (int i = 0; i < rows; i++) {
+            Matrix in_row = matrix_row(&CONTEXT_IN(fctx), i);
+            matrix_copy(&in_row, &steps[start + i].state);
+        }
+        Network_forward_ctx(nn, fctx);
+
+        Matrix *deltaOut = &bctx->deltas[nn->count];
+        for (int i = 0; i < rows; i++) {
+            Step *step = &steps[start + i];
+            float weight = (weights ? weights[start + i] : step->reward);
+            for (int j = 0; j < deltaOut->cols; j++) {
+                float P_k = MAT_AT(&CONTEXT_OUT(fctx), i, j);
+                MAT_AT(deltaOut, i, j) = (P_k - (step->action == j ? 1 : 0)) * weight;
+            }
+        }
+        Network_backward_ctx(nn, g, fctx, bctx);
+    }
+
+    Network_scale(g, 1.f / n);
+}
+
+void calc_QTargets_ctx(Network *TargetNN, ForwardContext *ctx, Matrix *QTargets, Step *steps, int *indexes) {
+    if (ctx->batch <= 0)
+        return;
+    float gamma = 0.99;
+    for (int start = 0; start < QTargets->rows; start += ctx->batch) {
+        int rows = (QTargets->rows - start < ctx->batch ? QTargets->rows - start : ctx->batch);
+        ForwardContext_set_rows(ctx, rows);
+        for (int i = 0; i < rows; i++) {
+            int curRandIdx = indexes[start + i];
+            Matrix in_row = matrix_row(&CONTEXT_IN(ctx), i);
+            if (steps[curRandIdx].death == false) {
+                matrix_copy(&in_row, &steps[curRandIdx + 1].state);
+            } else {
+                matrix_clear(&in_row);
+            }
+        }
+        Network_forward_ctx(TargetNN, ctx);
+
+        for (int i = 0; i < rows; i++) {
+            int curRandIdx = indexes[start + i];
+            if (steps[curRandIdx].death == false) {
+                float maxQ = MAT_AT(&CONTEXT_OUT(ctx), i, 0);
+                for (int j = 1; j < CONTEXT_OUT(ctx).cols; j++) {
+                    if (MAT_AT(&CONTEXT_OUT(ctx), i, j) > maxQ) {
+                        maxQ = MAT_AT(&CONTEXT_OUT(ctx), i, j);
+                    }
+                }
+                MAT_AT(QTargets, start + i, 0) = steps[curRandIdx].reward + (gamma * maxQ);
+            } else // if (steps[curRandIdx].death == true)
+            {
+                MAT_AT(QTargets, start + i, 0) = steps[curRandIdx].reward;
+            }
+        }
+    }
+}
+
+// Network sharing nn's parameters for layers [first, first + count), must not be freed
+Network network_segment(Network *nn, int first, int count) {
+    Network seg = {
+        .count = count,
+        .layers = &nn->layers[first],
+        .weights = &nn->weights[first],
+        .biases = &nn->biases[first],
+        .activations = (nn->activations ? &nn->activations[first] : NULL),
+        .plans = (nn->plans ? &nn->plans[first * GEMM_PLAN_BATCHES] : NULL),
+        .specs = (nn->specs ? &nn->specs[first] : NULL),
+    };
+    return seg;
+}
+
+// interval <= 0 picks sqrt(layers), which keeps the fewest activations
+// recurrent layers are not supported, recomputing them would advance their hidden state twice
+// returns false, leaving *out zeroed, for recurrent networks and batches below 1
+bool CheckpointContext_new(CheckpointContext *out, Network *nn, int batch, int interval) {
+    CheckpointContext ctx = {0};
+    *out = ctx;
+    if (Network_is_recurrent(nn)) {
+        fprintf(stderr, "Checkpointed training does not support recurrent layers\n");
+        return false;
+    }
+    if (batch <= 0) {
+        fprintf(stderr, "Checkpointed training needs a batch of at least 1\n");
+        return false;
+    }
+    if (interval <= 0)
+        interval = (int) ceil(sqrt(nn->count));
+    if (interval > nn->count)
+        interval = nn->count;
+
+    ctx.count = nn->count;
+    ctx.batch = batch;
+    ctx.interval = interval;
+    ctx.segments = (nn->count + interval - 1) / interval;
+    ctx.saved = calloc(sizeof(*ctx.saved), ctx.segments + 1);
+    for (int s = 0; s <= ctx.segments; s++) {
+        int layer = (s * interval < nn->count ? s * interval : nn->count);
+        ctx.saved[s] = matrix_new(batch, nn->layers[layer].cols);
+    }
+    ctx.delta = matrix_new(batch, NETWORK_OUT(nn).cols);
+    ctx.layers = calloc(sizeof(*ctx.layers), interval + 1);
+    ctx.deltas = calloc(sizeof(*ctx.deltas), interval + 1);
+    for (int i = 0; i <= nn->count; i++) {
+        if (nn->layers[i].cols > ctx.widest)
+            ctx.widest = nn->layers[i].cols;
+    }
+    size_t slot = (size_t) batch * ctx.widest;
+    ctx.layerWork = ml_calloc(slot * (interval > 1 ? interval - 1 : 1), sizeof(*ctx.layerWork));
+    ctx.deltaWork = ml_calloc(slot * (interval + 1), sizeof(*ctx.deltaWork));
+    ctx.columns = network_columns_new(nn, batch);
+    ctx.columnDeltas = network_columns_new(nn, batch);
+    *out = ctx;
+    return true;
+}
+
+void CheckpointContext_free(CheckpointContext *ctx) {
+    for (int s = 0; ctx->saved && s <= ctx->segments; s++) {
+        matrix_free(&ctx->saved[s]);
+    }
+    matrix_free(&ctx->delta);
+    free(ctx->saved);
+    free(ctx->layers);
+    free(ctx->deltas);
+    free(ctx->layerWork);
+    free(ctx->deltaWork);
+    free(ctx->columns);
+    free(ctx->columnDeltas);
+    ctx->columns = NULL;
+    ctx->columnDeltas = NULL;
+    ctx->saved = NULL;
+    ctx->layers = NULL;
+    ctx->deltas = NULL;
+    ctx->layerWork = NULL;
+    ctx->deltaWork = NULL;
+}
+
+void CheckpointContext_set_rows(CheckpointContext *ctx, int rows) {
+    if (rows > ctx->batch)
+        rows = ctx->batch;
+    for (int s = 0; s <= ctx->segments; s++) {
+        ctx->saved[s].rows = rows;
+    }
+    ctx->delta.rows = rows;
+}
+
+Matrix checkpoint_slot(CheckpointContext *ctx, float *work, int slot, int cols) {
+    Matrix m = {0};
+    m.rows = ctx->delta.rows;
+    m.cols = cols;
+    m.stride = cols;
+    m.data = work + (size_t) slot * ctx->batch * ctx->widest;
+    return m;
+}
+
+// points ctx->layers and ctx->deltas at segment s, returns how many layers it has
+// segment s hands its input delta down through the boundary slot segment s - 1 uses for its output
+int checkpoint_segment(Network *nn, CheckpointContext *ctx, int s) {
+    int first = s * ctx->interval;
+    int len = (ctx->count - first < ctx->interval ? ctx->count - first : ctx->interval);
+    ctx->layers[0] = ctx->saved[s];
+    for (int j = 1; j < len; j++) {
+        ctx->layers[j] = checkpoint_slot(ctx, ctx->layerWork, j - 1, nn->layers[first + j].cols);
+        ctx->deltas[j] = checkpoint_slot(ctx, ctx->deltaWork, j - 1, nn->layers[first + j].cols);
+    }
+    ctx->layers[len] = ctx->saved[s + 1];
+    ctx->deltas[0] = checkpoint_slot(ctx, ctx->deltaWork, ctx->interval - 1 + (s & 1), nn->layers[first].cols);
+    if (s == ctx->segments - 1) {
+        ctx->deltas[len] = ctx->delta;
+    } else {
+        ctx->deltas[len] = checkpoint_slot(ctx, ctx->deltaWork, ctx->interval - 1 + ((s + 1) & 1), nn->layers[first + len].cols);
+    }
+    return len;
+}
+
+// runs every row of CHECKPOINT_IN(ctx) through nn, keeping only the segment boundaries
+void Network_forward_checkpointed(Network *nn, CheckpointContext *ctx) {
+    for (int s = 0; s < ctx->segments; s++) {
+        int len = checkpoint_segment(nn, ctx, s);
+        Network seg = network_segment(nn, s * ctx->interval, len);
+        ForwardContext fctx = {
+            .count = len,
+            .batch = ctx->batch,
+            .streams = ctx->batch,
+            .layers = ctx->layers,
+            .columns = ctx->columns,
+        };
+        Network_forward_ctx(&seg, &fctx);
+    }
+}
+
+// accumulates the gradients of the batch last run through Network_forward_checkpointed into g,
+// recomputing each segment from its saved input on the way down
+// ctx->delta must hold dLoss/dOutput for every row
+void Network_backward_checkpointed(Network *nn, Network *g, CheckpointContext *ctx) {
+    for (int s = ctx->segments - 1; s >= 0; s--) {
+        int first = s * ctx->interval;
+        int len = checkpoint_segment(nn, ctx, s);
+        ForwardContext fctx = {
+            .count = len - 1,
+            .batch = ctx->batch,
+            .streams = ctx->batch,
+            .layers = ctx->layers,
+            .columns = ctx->columns,
+        };
+        // the output of the segment is already saved, only the layers inside it are recomputed
+        if (len > 1) {
+            Network inner = network_segment(nn, first, len - 1);
+            Network_forward_ctx(&inner, &fctx);
+        }
+
+        fctx.count = len;
+        BackwardContext bctx = {
+            .count = len,
+            .batch = ctx->batch,
+            .deltas = ctx->deltas,
+            .columns = ctx->columnDeltas,
+        };
+        Network seg = network_segment(nn, first, len);
+        Network gradSeg = network_segment(g, first, len);
+        network_backward(&seg, &gradSeg, &fctx, &bctx, s > 0);
+    }
+}
+
+// Network_backprop_ctx with a CheckpointContext
+void Network_backprop_checkpointed(Network *nn, Network *g, CheckpointContext *ctx, Matrix *in, Matrix *out) {
+    if (!ctx->saved || ctx->batch <= 0)
+        return;
+    if (in->rows != out->rows)
+        return;
+    if (CHECKPOINT_IN(ctx).cols != in->cols)
+        return;
+    if (CHECKPOINT_OUT(ctx).cols != out->cols)
+        return;
+    if (!Network_same(nn, g))
+        return;
+    int n = in->rows; // amount of samples
+
+    Network_clear(g);
+
+    for (int start = 0; start < n; start += ctx->batch) {
+        int rows = (n - start < ctx->batch ? n - start : ctx->batch);
+        CheckpointContext_set_rows(ctx, rows);
+        Matrix in_rows = matrix_rows(in, start, rows);
+        matrix_copy(&CHECKPOINT_IN(ctx), &in_rows);
+        Network_forward_checkpointed(nn, ctx);
+
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < out->cols; j++) {
+                MAT_AT(&ctx->delta, i, j) = 2 * (MAT_AT(&CHECKPOINT_OUT(ctx), i, j) - MAT_AT(out, start + i, j));
+            }
+        }
+        Network_backward_checkpointed(nn, g, ctx);
+    }
+
+    Network_scale(g, 1.f / n);
+}
+
+// binary inputs store only indexes, half the memory of index/value pairs
+SparseInput SparseInput_new(int cols, bool binary) {
+    SparseInput sp = {0};
+    sp.cols = cols;
+    sp.capacity = 64;
+    sp.rowCapacity = 16;
+    sp.offsets = calloc(sizeof(*sp.offsets), sp.rowCapacity + 1);
+    sp.indexes = malloc(sizeof(*sp.indexes) * sp.capacity);
+    sp.values = (binary ? NULL : malloc(sizeof(*sp.values) * sp.capacity));
+    return sp;
+}
+
+void SparseInput_free(SparseInput *sp) {
+    free(sp->offsets);
+    free(sp->indexes);
+    free(sp->values);
+    sp->offsets = NULL;
+    sp->indexes = NULL;
+    sp->values = NULL;
+    sp->rows = 0;
+    sp->count = 0;
+}
+
+// drops every row, keeps the memory
+void SparseInput_clear(SparseInput *sp) {
+    sp->rows = 0;
+    sp->count = 0;
+}
+
+// makes room for `n` more nonzeros and one more row
+void sparse_reserve(SparseInput *sp, int n) {
+    if (sp->count + n > sp->capacity) {
+        while (sp->count + n > sp->capacity) {
+            sp->capacity *= 2;
+        }
+        sp->indexes = realloc(sp->indexes, sizeof(*sp->indexes) * sp->capacity);
+        if (sp->values)
+            sp->values = realloc(sp->values, sizeof(*sp->values) * sp->capacity);
+    }
+    if (sp->rows + 1 > sp->rowCapacity) {
+        sp->rowCapacity *= 2;
+        sp->offsets = realloc(sp->offsets, sizeof(*sp->offsets) * (sp->rowCapacity + 1));
+    }
+}
+
+// appends a row with the given nonzeros, values is ignored (and may be NULL) for binary inputs
+void SparseInput_add(SparseInput *sp, int *indexes, float *values, int n) {
+    sparse_reserve(sp, n);
+    for (int i = 0; i < n; i++) {
+        if (indexes[i] < 0 || indexes[i] >= sp->cols) {
+            fprintf(stderr, "Sparse index %d is out of range\n", indexes[i]);
+            continue;
+        }
+        sp->indexes[sp->count] = indexes[i];
+        if (sp->values)
+            sp->values[sp->count] = (values ? values[i] : 1.f);
+        sp->count++;
+    }
+    sp->rows++;
+    sp->offsets[sp->rows] = sp->count;
+}
+
+// appends the nonzeros of a dense 1 x cols row
+void SparseInput_add_dense(SparseInput *sp, Matrix *row) {
+    if (row->cols != sp->cols)
+        return;
+    int n = 0;
+    for (int j = 0; j < row->cols; j++) {
+        if (MAT_AT(row, 0, j) != 0)
+            n++;
+    }
+    sparse_reserve(sp, n);
+    for (int j = 0; j < row->cols; j++) {
+        if (MAT_AT(row, 0, j) != 0) {
+            sp->indexes[sp->count] = j;
+            if (sp->values)
+                sp->values[sp->count] = MAT_AT(row, 0, j);
+            sp->count++;
+        }
+    }
+    sp->rows++;
+    sp->offsets[sp->rows] = sp->count;
+}
+
+int ml_ctz64(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+// appends a binary row given as a bitmask, bit j of bits[j / 64] is input j
+void SparseInput_add_bits(SparseInput *sp, uint64_t *bits) {
+    int words = (sp->cols + 63) / 64;
+    int n = 0;
+    for (int w = 0; w < words; w++) {
+        for (uint64_t word = bits[w]; word; word &= word - 1) {
+            n++;
+        }
+    }
+    sparse_reserve(sp, n);
+    for (int w = 0; w < words; w++) {
+        for (uint64_t word = bits[w]; word; word &= word - 1) {
+            int j = w * 64 + ml_ctz64(word);
+            if (j >= sp->cols)
+                break;
+            sp->indexes[sp->count] = j;
+            if (sp->values)
+                sp->values[sp->count] = 1.f;
+            sp->count++;
+        }
+    }
+    sp->rows++;
+    sp->offsets[sp->rows] = sp->count;
+}
+
+// replaces dest with rows[0..n) of src, for sampling minibatches out of a sparse replay buffer
+void SparseInput_gather(SparseInput *dest, SparseInput *src, int *rows, int n) {
+    if (dest->cols != src->cols || (dest->values == NULL) != (src->values == NULL))
+        return;
+    SparseInput_clear(dest);
+    for (int i = 0; i < n; i++) {
+        int start = src->offsets[rows[i]];
+        int len = src->offsets[rows[i] + 1] - start;
+        SparseInput_add(dest, &src->indexes[start], (src->values ? &src->values[start] : NULL), len);
+    }
+}
+
+// writes row `row` into a dense 1 x cols matrix
+void SparseInput_to_dense(SparseInput *sp, int row, Matrix *dest) {
+    if (dest->cols != sp->cols || row < 0 || row >= sp->rows)
+        return;
+    matrix_clear(dest);
+    for (int e = sp->offsets[row]; e < sp->offsets[row + 1]; e++) {
+        MAT_AT(dest, 0, sp->indexes[e]) = (sp->values ? sp->values[e] : 1.f);
+    }
+}
+
+// the first layer of nn for rows [start, start + rows) of in, written to rows [0, rows) of dest:
+// the bias plus the weight rows of the active inputs
+void sparse_layer_forward(Network *nn, Matrix *dest, SparseInput *in, int start, int rows) {
+    Matrix *weights = &nn->weights[0];
+    int cols = dest->cols;
+    for (int i = 0; i < rows; i++) {
+        float *out = &MAT_AT(dest, i, 0);
+        memcpy(out, &MAT_AT(&nn->biases[0], 0, 0), sizeof(*out) * cols);
+        for (int e = in->offsets[start + i]; e < in->offsets[start + i + 1]; e++) {
+            float *w = &MAT_AT(weights, in->indexes[e], 0);
+            if (in->values) {
+                float v = in->values[e];
+                for (int j = 0; j < cols; j++) {
+                    out[j] += v * w[j];
+                }
+            } else {
+                for (int j = 0; j < cols; j++) {
+                    out[j] += w[j];
+                }
+            }
+        }
+    }
+}
+
+// context over layers 1.. of ctx, to run everything above the sparse layer
+ForwardContext sparse_upper_context(ForwardContext *ctx) {
+    ForwardContext upper = *ctx;
+    upper.count = ctx->count - 1;
+    upper.layers = &ctx->layers[1];
+    upper.recurrent = (ctx->recurrent ? &ctx->recurrent[1] : NULL);
+    return upper;
+}
+
+void sparse_forward_rows(Network *nn, ForwardContext *ctx, SparseInput *in, int start, int rows) {
+    ForwardContext_set_rows(ctx, rows);
+    sparse_layer_forward(nn, &ctx->layers[1], in, start, rows);
+    if (nn->activations)
+        matrix_apply_activation(&ctx->layers[1], &nn->activations[0]);
+    Network upper = network_segment(nn, 1, nn->count - 1);
+    ForwardContext upperCtx = sparse_upper_context(ctx);
+    Network_forward_ctx(&upper, &upperCtx);
+}
+
+// Network_forward_ctx for sparse inputs, in->rows must fit in ctx->batch
+// the first layer must be dense, CONTEXT_IN(ctx) is not used
+void Network_forward_sparse(Network *nn, ForwardContext *ctx, SparseInput *in) {
+    if (in->cols != nn->weights[0].rows || in->rows > ctx->batch)
+        return;
+    if (Network_layer_type(nn, 0) != LAYER_DENSE) {
+        fprintf(stderr, "Sparse inputs need a dense first layer\n");
+        return;
+    }
+    sparse_forward_rows(nn, ctx, in, 0, in->rows);
+}
+
+void sparse_backward_rows(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx, SparseInput *in, int start) {
+    Network upper = network_segment(nn, 1, nn->count - 1);
+    Network gradUpper = network_segment(g, 1, nn->count - 1);
+    ForwardContext upperCtx = sparse_upper_context(fctx);
+    BackwardContext upperDeltas = *bctx;
+    upperDeltas.count = bctx->count - 1;
+    upperDeltas.deltas = &bctx->deltas[1];
+    upperDeltas.recurrent = (bctx->recurrent ? &bctx->recurrent[1] : NULL);
+    network_backward(&upper, &gradUpper, &upperCtx, &upperDeltas, true);
+
+    Matrix *delta = &bctx->deltas[1];
+    Matrix *output = &fctx->layers[1];
+    if (nn->activations && nn->activations[0].activationFunc) {
+        float (*derivativeFunc)(float) = getActDerivative(nn->activations[0].type);
+        if (derivativeFunc) {
+            for (int i = 0; i < delta->rows; i++) {
+                for (int j = 0; j < delta->cols; j++) {
+                    MAT_AT(delta, i, j) *= derivativeFunc(MAT_AT(output, i, j));
+                }
+            }
+        }
+    }
+
+    int cols = delta->cols;
+    for (int i = 0; i < delta->rows; i++) {
+        float *d = &MAT_AT(delta, i, 0);
+        for (int j = 0; j < cols; j++) {
+            MAT_AT(&g->biases[0], 0, j) += d[j];
+        }
+        for (int e = in->offsets[start + i]; e < in->offsets[start + i + 1]; e++) {
+            float *gw = &MAT_AT(&g->weights[0], in->indexes[e], 0);
+            float v = (in->values ? in->values[e] : 1.f);
+            for (int j = 0; j < cols; j++) {
+                gw[j] += v * d[j];
+            }
+        }
+    }
+}
+
+// Network_backward_ctx after Network_forward_sparse
+// only the rows of g->weights[0] belonging to inputs active in `in` are touched
+void Network_backward_sparse(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx, SparseInput *in) {
+    sparse_backward_rows(nn, g, fctx, bctx, in, 0);
+}
+
+// clears the parts of g a sparse backprop over `in` accumulates into
+void sparse_clear_gradient(Network *g, SparseInput *in) {
+    Network gradUpper = network_segment(g, 1, g->count - 1);
+    Network_clear(&gradUpper);
+    matrix_clear(&g->biases[0]);
+    for (int e = 0; e < in->count; e++) {
+        Matrix row = matrix_row(&g->weights[0], in->indexes[e]);
+        matrix_clear(&row);
+    }
+}
+
+// Network_backprop_ctx for sparse inputs, leaves the untouched rows of g->weights[0] alone,
+// so pair it with Network_gradient_descent_sparse on the same input
+void Network_backprop_sparse(Network *nn, Network *g, ForwardContext *fctx, BackwardContext *bctx, SparseInput *in, Matrix *out) {
+    if (fctx->batch <= 0)
+        return;
+    if (in->rows != out->rows)
+        return;
+    if (in->cols != nn->weights[0].rows)
+        return;
+    if (CONTEXT_OUT(fctx).cols != out->cols)
+        return;
+    if (!Network_same(nn, g))
+        return;
+    if (Network_layer_type(nn, 0) != LAYER_DENSE) {
+        fprintf(stderr, "Sparse inputs need a dense first layer\n");
+        return;
+    }
+    int n = in->rows; // amount of samples
+
+    // scaling the output deltas by 1 / n keeps the final Network_scale from touching every row
+    sparse_clear_gradient(g, in);
+    for (int start = 0; start < n; start += fctx->batch) {
+        int rows = (n - start < fctx->batch ? n - start : fctx->batch);
+        BackwardContext_set_rows(bctx, rows);
+        sparse_forward_rows(nn, fctx, in, start, rows);
+
+        Matrix *deltaOut = &bctx->deltas[nn->count];
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < out->cols; j++) {
+                MAT_AT(deltaOut, i, j) = 2 * (MAT_AT(&CONTEXT_OUT(fctx), i, j) - MAT_AT(out, start + i, j)) / n;
+            }
+        }
+        sparse_backward_rows(nn, g, fctx, bctx, in, start);
+    }
+}
+
+// Network_gradient_descent that only reads and updates the first layer rows active in `in`
+// those rows of g are cleared once applied, so repeated indexes are only applied once
+void Network_gradient_descent_sparse(Network *nn, Network *g, float rate, SparseInput *in) {
+    if (!Network_same(nn, g))
+        return;
+    Network upper = network_segment(nn, 1, nn->count - 1);
+    Network gradUpper = network_segment(g, 1, g->count - 1);
+    Network_gradient_descent(&upper, &gradUpper, rate);
+
+    for (int k = 0; k < nn->biases[0].cols; k++) {
+        MAT_AT(&nn->biases[0], 0, k) -= rate * MAT_AT(&g->biases[0], 0, k);
+    }
+    int cols = nn->weights[0].cols;
+    for (int e = 0; e < in->count; e++) {
+        float *w = &MAT_AT(&nn->weights[0], in->indexes[e], 0);
+        float *gw = &MAT_AT(&g->weights[0], in->indexes[e], 0);
+        for (int j = 0; j < cols; j++) {
+            w[j] -= rate * gw[j];
+            gw[j] = 0.f;
+        }
+    }
+}
+
+Trajectory Trajectory_new(int steps, int streams) {
+    Trajectory tr = {0};
+    size_t n = (size_t) steps * streams;
+    tr.steps = steps;
+    tr.streams = streams;
+    tr.rewards = calloc(sizeof(*tr.rewards), n);
+    tr.dones = calloc(sizeof(*tr.dones), n);
+    tr.values = calloc(sizeof(*tr.values), n);
+    tr.lastValues = calloc(sizeof(*tr.lastValues), streams);
+    tr.returns = calloc(sizeof(*tr.returns), n);
+    tr.advantages = calloc(sizeof(*tr.advantages), n);
+    return tr;
+}
+
+void Trajectory_free(Trajectory *tr) {
+    free(tr->rewards);
+    free(tr->dones);
+    free(tr->values);
+    free(tr->lastValues);
+    free(tr->returns);
+    free(tr->advantages);
+    tr->rewards = NULL;
+    tr->dones = NULL;
+    tr->values = NULL;
+    tr->lastValues = NULL;
+    tr->returns = NULL;
+    tr->advantages = NULL;
+}
+
+// copies reward and death out of steps * streams Steps laid out like the Trajectory
+void Trajectory_set_steps(Trajectory *tr, Step *steps) {
+    int n = tr->steps * tr->streams;
+    for (int i = 0; i < n; i++) {
+        tr->rewards[i] = steps[i].reward;
+        tr->dones[i] = (steps[i].death ? 1.f : 0.f);
+    }
+}
+
+// returns[i] = discounted sum of the rewards from step i to the end of its episode
+// episodes still running at the last step are bootstrapped from lastValues
+// the scans run backwards in time with environments in the inner loop, so they vectorize across streams
+void Trajectory_returns(Trajectory *tr, float gamma) {
+    int streams = tr->streams;
+    for (int t = tr->steps - 1; t >= 0; t--) {
+        float *reward = &tr->rewards[t * streams];
+        float *done = &tr->dones[t * streams];
+        float *next = (t + 1 < tr->steps ? &tr->returns[(t + 1) * streams] : tr->lastValues);
+        float *ret = &tr->returns[t * streams];
+        for (int e = 0; e < streams; e++) {
+            ret[e] = reward[e] + gamma * (1.f - done[e]) * next[e];
+        }
+    }
+}
+
+// returns[i] = n discounted rewards from step i plus the discounted value of the state after them,
+// cut short where the episode ends
+// one reverse pass: the n step return of step t is the one step return on top of step t + 1's n step
+// return, minus the discounted TD error of step t + n that falls out of the window (unless an episode
+// end inside the window already cut it off)
+void Trajectory_nstep(Trajectory *tr, float gamma, int n) {
+    int streams = tr->streams;
+    if (n <= 0) {
+        memcpy(tr->returns, tr->values, sizeof(*tr->returns) * tr->steps * streams);
+        return;
+    }
+    float gammaN = powf(gamma, (float) n);
+    for (int e0 = 0; e0 < streams; e0 += TRAJECTORY_WINDOW_STREAMS) {
+        int e1 = (e0 + TRAJECTORY_WINDOW_STREAMS < streams ? e0 + TRAJECTORY_WINDOW_STREAMS : streams);
+        int ends[TRAJECTORY_WINDOW_STREAMS] = {0}; // episode ends inside the window of every stream
+        for (int t = tr->steps - 1; t >= 0; t--) {
+            float *reward = &tr->rewards[t * streams];
+            float *done = &tr->dones[t * streams];
+            float *next = (t + 1 < tr->steps ? &tr->returns[(t + 1) * streams] : tr->lastValues);
+            float *ret = &tr->returns[t * streams];
+            // step t + n leaves the window, none once the window reaches the end of the trajectory
+            float *outReward = NULL, *outDone = NULL, *outValue = NULL, *outNext = NULL;
+            if (n < tr->steps - t) {
+                int out = t + n;
+                outReward = &tr->rewards[out * streams];
+                outDone = &tr->dones[out * streams];
+                outValue = &tr->values[out * streams];
+                outNext = (out + 1 < tr->steps ? &tr->values[(out + 1) * streams] : tr->lastValues);
+            }
+            for (int e = e0; e < e1; e++) {
+                int *inside = &ends[e - e0];
+                *inside += (done[e] != 0.f);
+                ret[e] = reward[e] + gamma * (1.f - done[e]) * next[e];
+                if (!outDone)
+                    continue;
+                *inside -= (outDone[e] != 0.f);
+                if (*inside == 0) {
+                    float tdError = outReward[e] + gamma * (1.f - outDone[e]) * outNext[e] - outValue[e];
+                    ret[e] -= gammaN * tdError;
+                }
+            }
+        }
+    }
+}
+
+// generalized advantage estimation, needs values (and lastValues for unfinished episodes)
+// advantages get the GAE(gamma, lambda) estimate and returns the matching value targets
+void Trajectory_gae(Trajectory *tr, float gamma, float lambda) {
+    int streams = tr->streams;
+    for (int t = tr->steps - 1; t >= 0; t--) {
+        float *reward = &tr->rewards[t * streams];
+        float *done = &tr->dones[t * streams];
+        float *value = &tr->values[t * streams];
+        float *adv = &tr->advantages[t * streams];
+        float *ret = &tr->returns[t * streams];
+        bool last = (t + 1 == tr->steps);
+        float *nextValue = (last ? tr->lastValues : &tr->values[(t + 1) * streams]);
+        float *nextAdv = (last ? NULL : &tr->advantages[(t + 1) * streams]);
+        for (int e = 0; e < streams; e++) {
+            float notDone = 1.f - done[e];
+            float delta = reward[e] + gamma * notDone * nextValue[e] - value[e];
+            adv[e] = delta + gamma * lambda * notDone * (last ? 0.f : nextAdv[e]);
+            ret[e] = adv[e] + value[e];
+        }
+    }
+}
+
+// shifts and scales x to mean 0 and standard deviation 1, usually tr->advantages
+void Trajectory_normalize(float *x, int n) {
+    if (n <= 0)
+        return;
+    double sum = 0.0;
+    double sumSq = 0.0;
+    for (int i = 0; i < n; i++) {
+        sum += x[i];
+        sumSq += (double) x[i] * x[i];
+    }
+    double mean = sum / n;
+    double var = sumSq / n - mean * mean;
+    float scale = (float) (1.0 / sqrt((var > 0 ? var : 0) + 1e-8));
+    for (int i = 0; i < n; i++) {
+        x[i] = (x[i] - (float) mean) * scale;
+    }
+}
+
+// every member starts as a copy of nn, which must only have dense layers
+Population Population_new(Network *nn, int size) {
+    Population pop = {0};
+    if (nn->specs) {
+        for (int i = 0; i < nn->count; i++) {
+            if (nn->specs[i].type != LAYER_DENSE) {
+                fprintf(stderr, "Population only supports dense layers\n");
+                return pop;
+            }
+        }
+    }
+    pop.size = size;
+    pop.count = nn->count;
+    pop.arch = Network_getArch(nn);
+    if (nn->activations) {
+        pop.activations = malloc(sizeof(*pop.activations) * nn->count);
+        memcpy(pop.activations, nn->activations, sizeof(*pop.activations) * nn->count);
+    }
+    pop.offsets = malloc(sizeof(*pop.offsets) * nn->count);
+    pop.paramCount = 0;
+    for (int i = 0; i < nn->count; i++) {
+        pop.offsets[i] = pop.paramCount;
+        pop.paramCount += (pop.arch[i] + 1) * pop.arch[i + 1];
+    }
+    pop.params = ml_calloc(sizeof(*pop.params), (size_t) pop.paramCount * size);
+    pop.spare = ml_calloc(sizeof(*pop.spare), (size_t) pop.paramCount * size);
+    for (int m = 0; m < size; m++) {
+        Population_set(&pop, m, nn);
+    }
+    return pop;
+}
+
+void Population_free(Population *pop) {
+    free(pop->arch);
+    free(pop->activations);
+    free(pop->offsets);
+    free(pop->params);
+    free(pop->spare);
+    pop->arch = NULL;
+    pop->activations = NULL;
+    pop->offsets = NULL;
+    pop->params = NULL;
+    pop->spare = NULL;
+}
+
+// views of one member's layer inside the stacked buffer
+void Population_weights(Population *pop, int member, int layer, Matrix *weights, Matrix *biases) {
+    float *base = pop->params + (long) member * pop->paramCount + pop->offsets[layer];
+    int rows = pop->arch[layer];
+    int cols = pop->arch[layer + 1];
+    Matrix w = {.rows = rows, .cols = cols, .stride = cols, .data = base};
+    Matrix b = {.rows = 1, .cols = cols, .stride = cols, .data = base + (long) rows * cols};
+    *weights = w;
+    *biases = b;
+}
+
+void Population_get(Population *pop, int member, Network *dest) {
+    if (!Network_cmpArch(dest, pop->arch, pop->count + 1))
+        return;
+    for (int i = 0; i < pop->count; i++) {
+        Matrix w, b;
+        Population_weights(pop, member, i, &w, &b);
+        matrix_copy(&dest->weights[i], &w);
+        matrix_copy(&dest->biases[i], &b);
+    }
+}
+
+void Population_set(Population *pop, int member, Network *src) {
+    if (!Network_cmpArch(src, pop->arch, pop->count + 1))
+        return;
+    for (int i = 0; i < pop->count; i++) {
+        Matrix w, b;
+        Population_weights(pop, member, i, &w, &b);
+        matrix_copy(&w, &src->weights[i]);
+        matrix_copy(&b, &src->biases[i]);
+    }
+}
+
+// workspace for Population_forward, member m reads its states from rows
+// [m * statesPerMember, (m + 1) * statesPerMember) of CONTEXT_IN and writes the same rows of CONTEXT_OUT
+ForwardContext Population_context(Population *pop, int statesPerMember) {
+    ForwardContext ctx = {0};
+    ctx.count = pop->count;
+    ctx.batch = pop->size * statesPerMember;
+    ctx.streams = ctx.batch;
+    ctx.layers = calloc(sizeof(*ctx.layers), pop->count + 1);
+    for (int i = 0; i <= pop->count; i++) {
+        ctx.layers[i] = matrix_new(ctx.batch, pop->arch[i]);
+    }
+    return ctx;
+}
+
+typedef struct POPULATION_TASK {
+    Population *pop;
+    ForwardContext *ctx;
+    int layer;
+    int chunks;
+    int *parents;
+    int elites;
+    float rate;
+    float sigma;
+    uint64_t seed;
+    float *weights;
+} PopulationTask;
+
+// one block of rows of one member through layer t->layer, the weights are read in place from the
+// stacked buffer at member * paramCount + offsets[layer]
+void population_forward_task(void *arg, int index) {
+    PopulationTask *t = arg;
+    Population *pop = t->pop;
+    int m = index / t->chunks;
+    int per = t->ctx->batch / pop->size;
+    int start = (index % t->chunks) * POPULATION_TASK_ROWS;
+    int rows = (per - start < POPULATION_TASK_ROWS ? per - start : POPULATION_TASK_ROWS);
+
+    Matrix w, b;
+    Population_weights(pop, m, t->layer, &w, &b);
+    Matrix in = matrix_rows(&t->ctx->layers[t->layer], m * per + start, rows);
+    Matrix out = matrix_rows(&t->ctx->layers[t->layer + 1], m * per + start, rows);
+    matrix_clear(&out);
+    gemm_block(&out, &in, &w, 0, rows, 0, w.rows, 0, w.cols);
+    matrix_add_row(&out, &b);
+    if (pop->activations)
+        matrix_apply_activation(&out, &pop->activations[t->layer]);
+}
+
+// runs every member on its own rows of CONTEXT_IN(ctx), layer by layer: each layer is one strided
+// batched GEMM over the stacked parameters, split into member x row block tasks on ThreadPool_default
+// false if ctx was not made by Population_context for this population
+bool Population_forward(Population *pop, ForwardContext *ctx) {
+    if (ctx->count != pop->count || pop->size <= 0 || ctx->batch % pop->size != 0) {
+        fprintf(stderr, "Context does not fit the population\n");
+        return false;
+    }
+    for (int i = 0; i <= pop->count; i++) {
+        if (ctx->layers[i].rows != ctx->batch || ctx->layers[i].cols != pop->arch[i]) {
+            fprintf(stderr, "Context does not fit the population\n");
+            return false;
+        }
+    }
+    int per = ctx->batch / pop->size;
+    if (per == 0)
+        return true;
+
+    PopulationTask task = {.pop = pop, .ctx = ctx};
+    task.chunks = (per + POPULATION_TASK_ROWS - 1) / POPULATION_TASK_ROWS;
+    for (int i = 0; i < pop->count; i++) {
+        task.layer = i;
+        ThreadPool_run(ThreadPool_default(), pop->size * task.chunks, population_forward_task, &task);
+    }
+    return true;
+}
+
+// adds N(0, sigma) noise to each parameter of params with chance rate
+void population_mutate_params(float *params, int n, Rng *rng, float rate, float sigma) {
+    float noise[256];
+    float mask[256];
+    for (int start = 0; start < n; start += (int) ARR_LEN(noise)) {
+        int chunk = (n - start < (int) ARR_LEN(noise) ? n - start : (int) ARR_LEN(noise));
+        Rng_fill_normal(rng, noise, chunk, 0.f, sigma);
+        Rng_fill_uniform(rng, mask, chunk, 0.f, 1.f);
+        for (int i = 0; i < chunk; i++) {
+            params[start + i] += (mask[i] < rate ? noise[i] : 0.f);
+        }
+    }
+}
+
+// members run in parallel, so each one draws from its own generator seeded off the caller's
+Rng population_member_rng(uint64_t seed, int member) {
+    uint64_t x = seed + (uint64_t) member * 0x9e3779b97f4a7c15ULL;
+    return Rng_new(rng_splitmix64(&x), 0);
+}
+
+uint64_t population_seed(Rng *rng) {
+    return ((uint64_t) Rng_u32(rng) << 32) | Rng_u32(rng);
+}
+
+void population_mutate_task(void *arg, int m) {
+    PopulationTask *t = arg;
+    Rng rng = population_member_rng(t->seed, m);
+    population_mutate_params(t->pop->params + (long) m * t->pop->paramCount, t->pop->paramCount, &rng, t->rate, t->sigma);
+}
+
+void Population_mutate(Population *pop, Rng *rng, float rate, float sigma) {
+    PopulationTask task = {.pop = pop, .rate = rate, .sigma = sigma, .seed = population_seed(rng)};
+    ThreadPool_run(ThreadPool_default(), pop->size, population_mutate_task, &task);
+}
+
+// uniform crossover, every parameter of dest comes from a or b with equal chance
+void population_crossover_params(float *dest, float *a, float *b, int n, Rng *rng) {
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        uint32_t bits = Rng_u32(rng);
+        for (int j = 0; j < 32; j++) {
+            dest[i + j] = ((bits >> j) & 1 ? b[i + j] : a[i + j]);
+        }
+    }
+    uint32_t bits = Rng_u32(rng);
+    for (int j = 0; i < n; i++, j++) {
+        dest[i] = ((bits >> j) & 1 ? b[i] : a[i]);
+    }
+}
+
+void Population_crossover(Population *pop, int dest, int a, int b, Rng *rng) {
+    long n = pop->paramCount;
+    population_crossover_params(pop->params + dest * n, pop->params + a * n, pop->params + b * n, pop->paramCount, rng);
+}
+
+void population_breed_task(void *arg, int child) {
+    PopulationTask *t = arg;
+    Population *pop = t->pop;
+    long n = pop->paramCount;
+    float *dest = pop->spare + child * n;
+    int a = t->parents[child * 2];
+    int b = t->parents[child * 2 + 1];
+    if (child < t->elites) {
+        memcpy(dest, pop->params + a * n, sizeof(*dest) * n);
+        return;
+    }
+    Rng rng = population_member_rng(t->seed, child);
+    population_crossover_params(dest, pop->params + a * n, pop->params + b * n, pop->paramCount, &rng);
+    population_mutate_params(dest, pop->paramCount, &rng, t->rate, t->sigma);
+}
+
+// one genetic algorithm generation, higher fitness is better
+// the best `elites` members survive unchanged, every other child is a uniform crossover
+// of two tournament winners followed by Population_mutate style noise
+void Population_evolve(Population *pop, float *fitness, int elites, int tournament, float rate, float sigma, Rng *rng) {
+    int *order = malloc(sizeof(*order) * pop->size);
+    int *parents = malloc(sizeof(*parents) * pop->size * 2);
+    for (int m = 0; m < pop->size; m++) {
+        order[m] = m;
+    }
+    // only the elites need to be in order
+    for (int i = 0; i < elites && i < pop->size; i++) {
+        for (int j = i + 1; j < pop->size; j++) {
+            if (fitness[order[j]] > fitness[order[i]]) {
+                int temp = order[i];
+                order[i] = order[j];
+                order[j] = temp;
+            }
+        }
+        parents[i * 2] = order[i];
+        parents[i * 2 + 1] = order[i];
+    }
+    for (int child = elites; child < pop->size; child++) {
+        for (int p = 0; p < 2; p++) {
+            int best = Rng_int(rng, 0, pop->size - 1);
+            for (int k = 1; k < tournament; k++) {
+                int other = Rng_int(rng, 0, pop->size - 1);
+                if (fitness[other] > fitness[best])
+                    best = other;
+            }
+            parents[child * 2 + p] = best;
+        }
+    }
+
+    PopulationTask task = {
+        .pop = pop,
+        .parents = parents,
+        .elites = elites,
+        .rate = rate,
+        .sigma = sigma,
+        .seed = population_seed(rng),
+    };
+    ThreadPool_run(ThreadPool_default(), pop->size, population_breed_task, &task);
+
+    float *temp = pop->params;
+    pop->params = pop->spare;
+    pop->spare = temp;
+    free(parents);
+    free(order);
+}
+
+// flattens the parameters of nn in Population layout
+void population_flatten(Population *pop, Network *nn, float *dest) {
+    for (int i = 0; i < pop->count; i++) {
+        Matrix w = {.rows = pop->arch[i], .cols = pop->arch[i + 1], .stride = pop->arch[i + 1], .data = dest + pop->offsets[i]};
+        Matrix b = {.rows = 1, .cols = pop->arch[i + 1], .stride = pop->arch[i + 1], .data = w.data + w.rows * w.cols};
+        matrix_copy(&w, &nn->weights[i]);
+        matrix_copy(&b, &nn->biases[i]);
+    }
+}
+
+void population_es_sample_task(void *arg, int pair) {
+    PopulationTask *t = arg;
+    Population *pop = t->pop;
+    float *center = t->weights;
+    float *plus = pop->params + (long) pair * 2 * pop->paramCount;
+    Rng rng = population_member_rng(t->seed, pair);
+    Rng_fill_normal(&rng, plus, pop->paramCount, 0.f, t->sigma);
+    if (pair * 2 + 1 < pop->size) {
+        float *minus = plus + pop->paramCount;
+        for (int i = 0; i < pop->paramCount; i++) {
+            minus[i] = center[i] - plus[i];
+        }
+    }
+    for (int i = 0; i < pop->paramCount; i++) {
+        plus[i] += center[i];
+    }
+}
+
+// evolution strategies: members become center + sigma * eps with antithetic pairs
+// (member 2k + 1 uses -eps of member 2k), so use an even population size
+void Population_es_sample(Population *pop, Network *center, float sigma, Rng *rng) {
+    if (!Network_cmpArch(center, pop->arch, pop->count + 1))
+        return;
+    float *flat = malloc(sizeof(*flat) * pop->paramCount);
+    population_flatten(pop, center, flat);
+    PopulationTask task = {.pop = pop, .sigma = sigma, .seed = population_seed(rng), .weights = flat};
+    ThreadPool_run(ThreadPool_default(), (pop->size + 1) / 2, population_es_sample_task, &task);
+    free(flat);
+}
+
+typedef struct ES_TASK {
+    Population *pop;
+    float *center;
+    float *weights;
+    float *grad;
+    float scale;
+} EsTask;
+
+void population_es_gradient_task(void *arg, int chunk) {
+    EsTask *t = arg;
+    Population *pop = t->pop;
+    int start = chunk * 1024;
+    int end = (start + 1024 < pop->paramCount ? start + 1024 : pop->paramCount);
+    for (int i = start; i < end; i++) {
+        t->grad[i] = 0.f;
+    }
+    for (int m = 0; m < pop->size; m++) {
+        float *member = pop->params + (long) m * pop->paramCount;
+        float w = t->weights[m];
+        for (int i = start; i < end; i++) {
+            t->grad[i] += w * (member[i] - t->center[i]);
+        }
+    }
+    for (int i = start; i < end; i++) {
+        t->grad[i] *= t->scale;
+    }
+}
+
+// estimates the gradient of the expected fitness at center from the members made by
+// Population_es_sample: grad = 1 / (n * sigma^2) * sum(F_m * (member_m - center))
+// fitness is standardized first, grad can go straight into Network_gradient_ascent
+void Population_es_gradient(Population *pop, Network *center, float *fitness, float sigma, Network *grad) {
+    if (!Network_cmpArch(center, pop->arch, pop->count + 1))
+        return;
+    if (!Network_cmpArch(grad, pop->arch, pop->count + 1))
+        return;
+
+    float mean = 0.f;
+    for (int m = 0; m < pop->size; m++) {
+        mean += fitness[m];
+    }
+    mean /= pop->size;
+    float var = 0.f;
+    for (int m = 0; m < pop->size; m++) {
+        var += (fitness[m] - mean) * (fitness[m] - mean);
+    }
+    float std = sqrtf(var / pop->size);
+
+    float *weights = malloc(sizeof(*weights) * pop->size);
+    for (int m = 0; m < pop->size; m++) {
+        weights[m] = (std > 0.f ? (fitness[m] - mean) / std : 0.f);
+    }
+    float *flatCenter = malloc(sizeof(*flatCenter) * pop->paramCount);
+    float *flatGrad = malloc(sizeof(*flatGrad) * pop->paramCount);
+    population_flatten(pop, center, flatCenter);
+
+    EsTask task = {
+        .pop = pop,
+        .center = flatCenter,
+        .weights = weights,
+        .grad = flatGrad,
+        .scale = 1.f / (pop->size * sigma * sigma),
+    };
+    ThreadPool_run(ThreadPool_default(), (pop->paramCount + 1023) / 1024, population_es_gradient_task, &task);
+
+    for (int i = 0; i < pop->count; i++) {
+        Matrix w = {.rows = pop->arch[i], .cols = pop->arch[i + 1], .stride = pop->arch[i + 1], .data = flatGrad + pop->offsets[i]};
+        Matrix b = {.rows = 1, .cols = pop->arch[i + 1], .stride = pop->arch[i + 1], .data = w.data + w.rows * w.cols};
+        matrix_copy(&grad->weights[i], &w);
+        matrix_copy(&grad->biases[i], &b);
+    }
+    free(flatGrad);
+    free(flatCenter);
+    free(weights);
+}
+
+const char datasetHeader[] = "mlds";
+
+// file layout: "mlds", rows, in cols, out cols (ints), in data, out data (floats, row major)
+bool Dataset_save(const char *path, Matrix *in, Matrix *out) {
+    if (in->rows != out->rows)
+        return false;
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "File could not be opened\n");
+        return false;
+    }
+    int shape[] = {in->rows, in->cols, out->cols};
+    fwrite(datasetHeader, sizeof(char), sizeof(datasetHeader) - 1, file);
+    fwrite(shape, sizeof(*shape), ARR_LEN(shape), file);
+    for (int i = 0; i < in->rows; i++) {
+        fwrite(&MAT_AT(in, i, 0), sizeof(*in->data), in->cols, file);
+    }
+    for (int i = 0; i < out->rows; i++) {
+        fwrite(&MAT_AT(out, i, 0), sizeof(*out->data), out->cols, file);
+    }
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+// maps a Dataset_save file read-only, the pages are shared with every other process mapping it
+bool Dataset_map(Dataset *ds, const char *path) {
+    memset(ds, 0, sizeof(*ds));
+#if defined(_WIN32) || defined(_WIN64)
+    ds->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (ds->file == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "File could not be opened\n");
+        return false;
+    }
+    LARGE_INTEGER size;
+    GetFileSizeEx(ds->file, &size);
+    ds->size = (size_t) size.QuadPart;
+    ds->map = CreateFileMappingA(ds->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    ds->mapping = (ds->map ? MapViewOfFile(ds->map, FILE_MAP_READ, 0, 0, 0) : NULL);
+    if (!ds->mapping) {
+        fprintf(stderr, "File could not be mapped\n");
+        Dataset_unmap(ds);
+        return false;
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "File could not be opened\n");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    ds->size = (size_t) st.st_size;
+    ds->mapping = mmap(NULL, ds->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ds->mapping == MAP_FAILED) {
+        ds->mapping = NULL;
+        fprintf(stderr, "File could not be mapped\n");
+        return false;
+    }
+#endif
+
+    unsigned long headerLen = sizeof(datasetHeader) - 1;
+    int shape[3];
+    if (ds->size < headerLen + sizeof(shape) || strncmp(ds->mapping, datasetHeader, headerLen) != 0) {
+        fprintf(stderr, "Invalid dataset file\n");
+        Dataset_unmap(ds);
+        return false;
+    }
+    memcpy(shape, (char *) ds->mapping + headerLen, sizeof(shape));
+    if (shape[0] <= 0 || shape[1] <= 0 || shape[2] <= 0) {
+        fprintf(stderr, "Invalid dataset file\n");
+        Dataset_unmap(ds);
+        return false;
+    }
+    size_t expected = headerLen + sizeof(shape) + sizeof(float) * (size_t) shape[0] * (shape[1] + shape[2]);
+    if (ds->size < expected) {
+        fprintf(stderr, "Invalid dataset file\n");
+        Dataset_unmap(ds);
+        return false;
+    }
+    float *data = (float *) ((char *) ds->mapping + headerLen + sizeof(shape));
+    ds->in = (Matrix) {.rows = shape[0], .cols = shape[1], .stride = shape[1], .data = data};
+    ds->out = (Matrix) {.rows = shape[0], .cols = shape[2], .stride = shape[2], .data = data + (size_t) shape[0] * shape[1]};
+    return true;
+}
+
+void Dataset_unmap(Dataset *ds) {
+#if defined(_WIN32) || defined(_WIN64)
+    if (ds->mapping)
+        UnmapViewOfFile(ds->mapping);
+    if (ds->map)
+        CloseHandle(ds->map);
+    if (ds->file && ds->file != INVALID_HANDLE_VALUE)
+        CloseHandle(ds->file);
+    ds->map = NULL;
+    ds->file = NULL;
+#else
+    if (ds->mapping)
+        munmap(ds->mapping, ds->size);
+#endif
+    ds->mapping = NULL;
+    ds->in.data = NULL;
+    ds->out.data = NULL;
+}
+
+void sweep_trial_init(SweepTrial *trial, SweepSpace *space, int id, int layers, float rate) {
+    memset(trial, 0, sizeof(*trial));
+    trial->id = id;
+    trial->archLen = layers + 2;
+    trial->arch[0] = space->inputs;
+    trial->arch[layers + 1] = space->outputs;
+    trial->activations[layers] = space->outputActivation;
+    trial->rate = rate;
+    trial->loss = INFINITY;
+}
+
+// trials hold at most SWEEP_MAX_LAYERS hidden layers, every list a trial picks from must be non empty
+bool sweep_space_valid(SweepSpace *space) {
+    if (space->minLayers < 0 || space->maxLayers > SWEEP_MAX_LAYERS || space->minLayers > space->maxLayers ||
+        space->inputs <= 0 || space->outputs <= 0 || space->sizeCount <= 0 || space->activationCount <= 0) {
+        fprintf(stderr, "Invalid sweep space, hidden layers must be within 0 to %d\n", SWEEP_MAX_LAYERS);
+        return false;
+    }
+    return true;
+}
+
+// every depth x width x activation x rate combination, every hidden layer of a trial gets the same width
+SweepTrial *Sweep_grid(SweepSpace *space, int *count) {
+    *count = 0;
+    if (!sweep_space_valid(space) || space->rateCount <= 0)
+        return NULL;
+    int depths = space->maxLayers - space->minLayers + 1;
+    // every partial product is checked before the next factor, so the long long never overflows
+    long long combinations = (long long) depths * space->sizeCount;
+    if (combinations <= INT_MAX)
+        combinations *= space->activationCount;
+    if (combinations <= INT_MAX)
+        combinations *= space->rateCount;
+    if (combinations > INT_MAX) {
+        fprintf(stderr, "Sweep grid has more than %d combinations\n", INT_MAX);
+        return NULL;
+    }
+    SweepTrial *trials = malloc(sizeof(*trials) * combinations);
+    if (!trials) {
+        fprintf(stderr, "Sweep grid of %lld combinations could not be allocated\n", combinations);
+        return NULL;
+    }
+    *count = (int) combinations;
+    int id = 0;
+    for (int d = 0; d < depths; d++) {
+        int layers = space->minLayers + d;
+        for (int w = 0; w < space->sizeCount; w++) {
+            for (int a = 0; a < space->activationCount; a++) {
+                for (int r = 0; r < space->rateCount; r++) {
+                    SweepTrial *trial = &trials[id];
+                    sweep_trial_init(trial, space, id, layers, space->rates[r]);
+                    for (int l = 0; l < layers; l++) {
+                        trial->arch[l + 1] = space->sizes[w];
+                        trial->activations[l] = space->activations[a];
+                    }
+                    id++;
+                }
+            }
+        }
+    }
+    return trials;
+}
+
+// independent width and activation per hidden layer, log uniform learning rate
+SweepTrial *Sweep_random(SweepSpace *space, int count, Rng *rng) {
+    if (!sweep_space_valid(space) || count <= 0 || !(space->minRate > 0.f) || !(space->maxRate > 0.f))
+        return NULL;
+    SweepTrial *trials = malloc(sizeof(*trials) * count);
+    for (int id = 0; id < count; id++) {
+        int layers = Rng_int(rng, space->minLayers, space->maxLayers);
+        float rate = expf(logf(space->minRate) + Rng_float(rng) * (logf(space->maxRate) - logf(space->minRate)));
+        SweepTrial *trial = &trials[id];
+        sweep_trial_init(trial, space, id, layers, rate);
+        for (int l = 0; l < layers; l++) {
+            trial->arch[l + 1] = space->sizes[Rng_int(rng, 0, space->sizeCount - 1)];
+            trial->activations[l] = space->activations[Rng_int(rng, 0, space->activationCount - 1)];
+        }
+    }
+    return trials;
+}
+
+void sweep_trial_release(SweepTrial *trial) {
+    if (!trial->nn.layers)
+        return;
+    Network_free(&trial->nn);
+    Network_free(&trial->g);
+    ForwardContext_free(&trial->fctx);
+    BackwardContext_free(&trial->bctx);
+}
+
+typedef struct SWEEP_TASK {
+    SweepTrial **alive;
+    Dataset *train;
+    Dataset *valid;
+    SweepConfig *config;
+    int epochs;
+} SweepTask;
+
+void sweep_train_task(void *arg, int index) {
+    SweepTask *t = arg;
+    SweepTrial *trial = t->alive[index];
+    int batch = t->config->batch;
+    // a new stream per rung so resumed trials do not replay the same minibatch order
+    Rng rng = Rng_new(t->config->seed + trial->id, trial->epochs);
+    if (!trial->nn.layers) {
+        trial->nn = NeuralNetwork(trial->arch, trial->archLen, trial->activations);
+        trial->g = NeuralNetwork(trial->arch, trial->archLen, trial->activations);
+        Network_xavier_init_rng(&trial->nn, &rng);
+        trial->fctx = ForwardContext_new(&trial->nn, batch);
+        trial->bctx = BackwardContext_new(&trial->nn, batch);
+    }
+
+    // minibatches are windows of the mapped rows visited in a shuffled order, the data itself is never touched
+    Matrix *in = &t->train->in;
+    Matrix *out = &t->train->out;
+    int blocks = (in->rows + batch - 1) / batch;
+    int *order = malloc(sizeof(*order) * blocks);
+    for (; trial->epochs < t->epochs; trial->epochs++) {
+        for (int b = 0; b < blocks; b++) {
+            order[b] = b;
+        }
+        for (int b = 0; b < blocks - 1; b++) {
+            int j = Rng_int(&rng, b, blocks - 1);
+            int temp = order[b];
+            order[b] = order[j];
+            order[j] = temp;
+        }
+        for (int b = 0; b < blocks; b++) {
+            int start = order[b] * batch;
+            int rows = (in->rows - start < batch ? in->rows - start : batch);
+            Matrix inRows = matrix_rows(in, start, rows);
+            Matrix outRows = matrix_rows(out, start, rows);
+            Network_backprop_ctx(&trial->nn, &trial->g, &trial->fctx, &trial->bctx, &inRows, &outRows);
+            Network_gradient_descent(&trial->nn, &trial->g, trial->rate);
+        }
+    }
+    free(order);
+
+    Dataset *valid = (t->valid ? t->valid : t->train);
+    trial->loss = Network_cost_ctx(&trial->nn, &trial->fctx, &valid->in, &valid->out);
+    if (isnan(trial->loss))
+        trial->loss = INFINITY;
+}
+
+int sweep_compare(const void *a, const void *b) {
+    const SweepTrial *x = *(SweepTrial *const *) a;
+    const SweepTrial *y = *(SweepTrial *const *) b;
+    return (x->loss > y->loss) - (x->loss < y->loss);
+}
+
+// successive halving: every alive trial is trained to minEpochs, the best 1 / eta continue
+// to eta times the budget, and so on until one rung reaches maxEpochs
+// up to config->threads trials train at once, all reading the same mapped Dataset
+void Sweep_run(SweepTrial *trials, int count, Dataset *train, Dataset *valid, SweepConfig *config) {
+    if (!trials || count <= 0)
+        return;
+    SweepTrial **alive = malloc(sizeof(*alive) * count);
+    int aliveCount = count;
+    for (int i = 0; i < count; i++) {
+        alive[i] = &trials[i];
+    }
+    ThreadPool *pool = ThreadPool_new(config->threads);
+    int eta = (config->eta > 1 ? config->eta : 2);
+    int epochs = (config->minEpochs > 0 ? config->minEpochs : 1);
+
+    for (;;) {
+        if (epochs > config->maxEpochs || aliveCount == 1)
+            epochs = config->maxEpochs;
+        SweepTask task = {.alive = alive, .train = train, .valid = valid, .config = config, .epochs = epochs};
+        ThreadPool_run(pool, aliveCount, sweep_train_task, &task);
+        qsort(alive, aliveCount, sizeof(*alive), sweep_compare);
+        if (config->verbose)
+            printf("rung %d epochs: %d trials, best loss %f\n", epochs, aliveCount, alive[0]->loss);
+        if (epochs >= config->maxEpochs)
+            break;
+
+        int keep = (aliveCount + eta - 1) / eta;
+        for (int i = keep; i < aliveCount; i++) {
+            alive[i]->stopped = true;
+            sweep_trial_release(alive[i]);
+        }
+        aliveCount = keep;
+        epochs *= eta;
+    }
+
+    ThreadPool_free(pool);
+    free(alive);
+}
+
+void Sweep_free(SweepTrial *trials, int count) {
+    for (int i = 0; i < count; i++) {
+        sweep_trial_release(&trials[i]);
+    }
+    free(trials);
+}
+
+// trials that got further rank first, a short run with a low loss is not a winner
+int sweep_compare_leaderboard(const void *a, const void *b) {
+    const SweepTrial *x = *(SweepTrial *const *) a;
+    const SweepTrial *y = *(SweepTrial *const *) b;
+    if (x->epochs != y->epochs)
+        return y->epochs - x->epochs;
+    return sweep_compare(a, b);
+}
+
+SweepTrial **sweep_leaderboard(SweepTrial *trials, int count) {
+    SweepTrial **sorted = malloc(sizeof(*sorted) * count);
+    for (int i = 0; i < count; i++) {
+        sorted[i] = &trials[i];
+    }
+    qsort(sorted, count, sizeof(*sorted), sweep_compare_leaderboard);
+    return sorted;
+}
+
+bool Sweep_write_csv(SweepTrial *trials, int count, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "File could not be opened\n");
+        return false;
+    }
+    SweepTrial **sorted = sweep_leaderboard(trials, count);
+    fprintf(file, "rank,id,loss,epochs,stopped,rate,arch,activations\n");
+    for (int i = 0; i < count; i++) {
+        SweepTrial *t = sorted[i];
+        fprintf(file, "%d,%d,%g,%d,%d,%g,", i + 1, t->id, t->loss, t->epochs, t->stopped, t->rate);
+        for (int l = 0; l < t->archLen; l++) {
+            fprintf(file, "%s%d", (l ? "-" : ""), t->arch[l]);
+        }
+        fprintf(file, ",");
+        for (int l = 0; l < t->archLen - 1; l++) {
+            fprintf(file, "%s%s", (l ? "-" : ""), getActName(t->activations[l]));
+        }
+        fprintf(file, "\n");
+    }
+    free(sorted);
+    fclose(file);
+    return true;
+}
+
+bool Sweep_write_json(SweepTrial *trials, int count, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "File could not be opened\n");
+        return false;
+    }
+    SweepTrial **sorted = sweep_leaderboard(trials, count);
+    fprintf(file, "[\n");
+    for (int i = 0; i < count; i++) {
+        SweepTrial *t = sorted[i];
+        fprintf(file, "    {\"rank\": %d, \"id\": %d, ", i + 1, t->id);
+        if (isinf(t->loss))
+            fprintf(file, "\"loss\": null, ");
+        else
+            fprintf(file, "\"loss\": %g, ", t->loss);
+        fprintf(file, "\"epochs\": %d, \"stopped\": %s, \"rate\": %g, \"arch\": [", t->epochs, (t->stopped ? "true" : "false"), t->rate);
+        for (int l = 0; l < t->archLen; l++) {
+            fprintf(file, "%s%d", (l ? ", " : ""), t->arch[l]);
+        }
+        fprintf(file, "], \"activations\": [");
+        for (int l = 0; l < t->archLen - 1; l++) {
+            fprintf(file, "%s\"%s\"", (l ? ", " : ""), getActName(t->activations[l]));
+        }
+        fprintf(file, "]}%s\n", (i + 1 < count ? "," : ""));
+    }
+    fprintf(file, "]\n");
+    free(sorted);
+    fclose(file);
+    return true;
+}
+
+void Histogram_add(Histogram *h, unsigned long value) {
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && value + 1 >= (2UL << bucket)) {
+        bucket++;
+    }
+    atomic_fetch_add(&h->counts[bucket], 1);
+}
+
+unsigned long Histogram_count(Histogram *h) {
+    unsigned long total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        total += atomic_load(&h->counts[i]);
+    }
+    return total;
+}
+
+// upper bound of the bucket holding the p-th quantile (0 <= p <= 1)
+unsigned long Histogram_percentile(Histogram *h, float p) {
+    unsigned long total = Histogram_count(h);
+    unsigned long target = (unsigned long) ceilf(p * total);
+    unsigned long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += atomic_load(&h->counts[i]);
+        if (seen >= target && seen > 0)
+            return (2UL << i) - 2;
+    }
+    return 0;
+}
+
+void Histogram_print(Histogram *h, const char *name) {
+    printf("%s: n = %lu, p50 <= %lu, p90 <= %lu, p99 <= %lu\n", name, Histogram_count(h),
+           Histogram_percentile(h, 0.5f), Histogram_percentile(h, 0.9f), Histogram_percentile(h, 0.99f));
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        unsigned long count = atomic_load(&h->counts[i]);
+        if (count)
+            printf("    [%lu, %lu) %lu\n", (1UL << i) - 1, (2UL << i) - 1, count);
+    }
+}
+
+void *inferenceserver_worker(void *arg) {
+    InferenceServer *server = arg;
+    InferenceRequest **batch = malloc(sizeof(*batch) * server->maxBatch);
+    int inputs = CONTEXT_IN(&server->ctx).cols;
+    int outputs = CONTEXT_OUT(&server->ctx).cols;
+
+    pthread_mutex_lock(&server->lock);
+    for (;;) {
+        while (!server->stop && server->depth == 0) {
+            pthread_cond_wait(&server->pending, &server->lock);
+        }
+        if (server->stop && server->depth == 0)
+            break;
+
+        // wait for the batch to fill up or for the earliest deadline in the queue
+        while (!server->stop && server->depth < server->maxBatch) {
+            double deadline = server->head->deadline;
+            for (InferenceRequest *r = server->head->next; r; r = r->next) {
+                if (r->deadline < deadline)
+                    deadline = r->deadline;
+            }
+            double remaining = deadline - ml_time();
+            if (remaining <= 0)
+                break;
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            long nsec = until.tv_nsec + (long) ((remaining - (long) remaining) * 1e9);
+            until.tv_sec += (time_t) remaining + nsec / 1000000000L;
+            until.tv_nsec = nsec % 1000000000L;
+            pthread_cond_timedwait(&server->pending, &server->lock, &until);
+        }
+
+        Histogram_add(&server->queueDepth, server->depth);
+        int rows = 0;
+        while (server->head && rows < server->maxBatch) {
+            batch[rows++] = server->head;
+            server->head = server->head->next;
+            server->depth--;
+        }
+        if (!server->head)
+            server->tail = NULL;
+        pthread_mutex_unlock(&server->lock);
+
+        ForwardContext_set_rows(&server->ctx, rows);
+        for (int i = 0; i < rows; i++) {
+            memcpy(&MAT_AT(&CONTEXT_IN(&server->ctx), i, 0), batch[i]->input, sizeof(float) * inputs);
+        }
+        if (server->publisher) {
+            Network *snapshot = NetworkPublisher_acquire(server->publisher, NULL);
+            Network_forward_ctx(snapshot, &server->ctx);
+            NetworkPublisher_release(server->publisher, snapshot);
+        } else if (server->shared) {
+            Network *snapshot = SharedNetwork_acquire(server->shared, NULL);
+            Network_forward_ctx(snapshot, &server->ctx);
+            SharedNetwork_release(server->shared, snapshot);
+        } else {
+            Network_forward_ctx(server->nn, &server->ctx);
+        }
+        Histogram_add(&server->batchSize, rows);
+
+        pthread_mutex_lock(&server->lock);
+        double now = ml_time();
+        for (int i = 0; i < rows; i++) {
+            memcpy(batch[i]->output, &MAT_AT(&CONTEXT_OUT(&server->ctx), i, 0), sizeof(float) * outputs);
+            batch[i]->done = true;
+            Histogram_add(&server->latency, (unsigned long) ((now - batch[i]->arrival) * 1e6));
+        }
+        pthread_cond_broadcast(&server->finished);
+    }
+    pthread_mutex_unlock(&server->lock);
+    free(batch);
+    return NULL;
+}
+
+// nn is the Network to size the server for, publisher or shared (at most one) hand out newer weights
+InferenceServer *inferenceserver_new(Network *nn, NetworkPublisher *publisher, SharedNetwork *shared, int maxBatch, double maxDelay) {
+    if (Network_is_recurrent(nn)) {
+        fprintf(stderr, "InferenceServer can not keep hidden state per client\n");
+        return NULL;
+    }
+    InferenceServer *server = calloc(1, sizeof(*server));
+    server->nn = nn;
+    server->publisher = publisher;
+    server->shared = shared;
+    server->maxBatch = (maxBatch > 0 ? maxBatch : 1);
+    server->maxDelay = maxDelay;
+    server->ctx = ForwardContext_new(server->nn, server->maxBatch);
+    server->listenFd = -1;
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->pending, NULL);
+    pthread_cond_init(&server->finished, NULL);
+    pthread_cond_init(&server->closed, NULL);
+    pthread_create(&server->worker, NULL, inferenceserver_worker, server);
+    return server;
+}
+
+// nn is only read, give either nn or a publisher to serve its snapshots
+// requests are batched with whoever else is waiting, so recurrent networks can not be served
+InferenceServer *InferenceServer_new(Network *nn, NetworkPublisher *publisher, int maxBatch, double maxDelay) {
+    return inferenceserver_new((publisher ? &publisher->buffers[0] : nn), publisher, NULL, maxBatch, maxDelay);
+}
+
+// serves the latest generation of a shared memory model, every batch picks up a newly published one
+InferenceServer *InferenceServer_new_shared(SharedNetwork *shared, int maxBatch, double maxDelay) {
+    return inferenceserver_new(&shared->views[0], NULL, shared, maxBatch, maxDelay);
+}
+
+// runs one row through the server's Network, blocks until the batch containing it is done
+// maxDelay < 0 uses the server's default
+// input has NETWORK_IN(nn).cols floats, output gets NETWORK_OUT(nn).cols floats
+bool InferenceServer_infer(InferenceServer *server, float *input, float *output, double maxDelay) {
+    InferenceRequest request = {
+        .input = input,
+        .output = output,
+        .arrival = ml_time(),
+        .done = false,
+        .next = NULL,
+    };
+    request.deadline = request.arrival + (maxDelay < 0 ? server->maxDelay : maxDelay);
+
+    pthread_mutex_lock(&server->lock);
+    if (server->stop) {
+        pthread_mutex_unlock(&server->lock);
+        return false;
+    }
+    if (server->tail)
+        server->tail->next = &request;
+    else
+        server->head = &request;
+    server->tail = &request;
+    server->depth++;
+    pthread_cond_signal(&server->pending);
+    while (!request.done) {
+        pthread_cond_wait(&server->finished, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+    return true;
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+bool inferenceserver_io(int fd, void *buffer, size_t size, bool writing) {
+    char *bytes = buffer;
+    while (size > 0) {
+        ssize_t n = (writing ? write(fd, bytes, size) : read(fd, bytes, size));
+        if (n <= 0)
+            return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+// protocol: the client writes input rows as raw floats, the server answers each with an output row
+void *inferenceserver_connection(void *arg) {
+    InferenceConnection *connection = arg;
+    InferenceServer *server = connection->server;
+    size_t inputSize = sizeof(float) * CONTEXT_IN(&server->ctx).cols;
+    size_t outputSize = sizeof(float) * CONTEXT_OUT(&server->ctx).cols;
+    float *input = malloc(inputSize);
+    float *output = malloc(outputSize);
+    while (inferenceserver_io(connection->fd, input, inputSize, false)) {
+        if (!InferenceServer_infer(server, input, output, -1))
+            break;
+        if (!inferenceserver_io(connection->fd, output, outputSize, true))
+            break;
+    }
+    free(input);
+    free(output);
+
+    pthread_mutex_lock(&server->lock);
+    for (InferenceConnection **c = &server->connections; *c; c = &(*c)->next) {
+        if (*c == connection) {
+            *c = connection->next;
+            break;
+        }
+    }
+    close(connection->fd);
+    free(connection);
+    pthread_cond_broadcast(&server->closed);
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+void *inferenceserver_accept(void *arg) {
+    InferenceServer *server = arg;
+    for (;;) {
+        int fd = accept(server->listenFd, NULL, NULL);
+        if (fd < 0)
+            break;
+        pthread_mutex_lock(&server->lock);
+        if (server->stop) {
+            pthread_mutex_unlock(&server->lock);
+            close(fd);
+            break;
+        }
+        InferenceConnection *connection = malloc(sizeof(*connection));
+        connection->server = server;
+        connection->fd = fd;
+        connection->next = server->connections;
+        server->connections = connection;
+        pthread_mutex_unlock(&server->lock);
+
+        pthread_t thread;
+        pthread_create(&thread, NULL, inferenceserver_connection, connection);
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+#endif
+
+// serves InferenceServer_infer on a local unix socket, for testing with real clients
+bool InferenceServer_listen(InferenceServer *server, const char *path) {
+#if defined(_WIN32) || defined(_WIN64)
+    (void) server;
+    (void) path;
+    fprintf(stderr, "Unix sockets are not supported on this platform\n");
+    return false;
+#else
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path) || server->listening)
+        return false;
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(fd, 64) != 0) {
+        fprintf(stderr, "Socket could not be opened\n");
+        close(fd);
+        return false;
+    }
+    server->listenFd = fd;
+    server->listening = true;
+    strcpy(server->socketPath, path);
+    pthread_create(&server->acceptThread, NULL, inferenceserver_accept, server);
+    return true;
+#endif
+}
+
+// finishes the queued requests, then stops the worker and the socket front end
+void InferenceServer_free(InferenceServer *server) {
+    pthread_mutex_lock(&server->lock);
+    server->stop = true;
+    pthread_cond_broadcast(&server->pending);
+    pthread_mutex_unlock(&server->lock);
+    pthread_join(server->worker, NULL);
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    if (server->listening) {
+        shutdown(server->listenFd, SHUT_RDWR);
+        close(server->listenFd);
+        pthread_join(server->acceptThread, NULL);
+        unlink(server->socketPath);
+    }
+    // wake connections blocked on their client, they close and unlink themselves
+    pthread_mutex_lock(&server->lock);
+    for (InferenceConnection *c = server->connections; c; c = c->next) {
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    while (server->connections) {
+        pthread_cond_wait(&server->closed, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+#endif
+
+    ForwardContext_free(&server->ctx);
+    pthread_cond_destroy(&server->closed);
+    pthread_cond_destroy(&server->finished);
+    pthread_cond_destroy(&server->pending);
+    pthread_mutex_destroy(&server->lock);
+    free(server);
+}
+
+void InferenceServer_print_stats(InferenceServer *server) {
+    Histogram_print(&server->queueDepth, "queue depth");
+    Histogram_print(&server->batchSize, "batch size");
+    Histogram_print(&server->latency, "latency (us)");
+}
+
+// allocates one clone of nn bound to every NUMA node, keeping the caller's huge page choice
+NetworkReplicas NetworkReplicas_new(Network *nn) {
+    NetworkReplicas rep = {0};
+    rep.nodes = ml_numa_nodes();
+    rep.replicas = calloc(sizeof(*rep.replicas), rep.nodes);
+    AllocPolicy policy = mlAllocPolicy;
+    for (int i = 0; i < rep.nodes; i++) {
+        AllocPolicy local = policy;
+        local.node = i;
+        local.interleave = false;
+        ml_set_alloc_policy(local);
+        rep.replicas[i] = Network_clone(nn);
+    }
+    ml_set_alloc_policy(policy);
+    return rep;
+}
+
+void NetworkReplicas_free(NetworkReplicas *rep) {
+    for (int i = 0; i < rep->nodes; i++) {
+        Network_free(&rep->replicas[i]);
+    }
+    free(rep->replicas);
+    rep->replicas = NULL;
+    rep->nodes = 0;
+}
+
+// pushes new weights to every replica, readers must not run while this copies
+void NetworkReplicas_sync(NetworkReplicas *rep, Network *nn) {
+    for (int i = 0; i < rep->nodes; i++) {
+        Network_copy(&rep->replicas[i], nn);
+    }
+}
 
-    Network_clear(g);
+// replica on the calling thread's node, pin inference threads so this stays local
+Network *NetworkReplicas_local(NetworkReplicas *rep) {
+    int node = ml_current_node();
+    return &rep->replicas[(node >= 0 && node < rep->nodes ? node : 0)];
+}
 
-    // i = current sample
-    // l = current layer
-    // j = current "node"
-    // k = previous "node"
+// NetworkPublisher lets a training thread hand out weight snapshots to any number of
+// reader threads without locks. The trainer keeps updating its own Network and every
+// `interval` steps copies it into a free buffer and atomically swaps the published index.
+// Readers pin the published buffer with a per-buffer counter, so the writer never reuses
+// a buffer while somebody is still reading it.
+//
+// DQN target networks use the same mechanism: publish the online Network every
+// `interval` steps and sync the target with NetworkPublisher_read before calc_QTargets.
+NetworkPublisher NetworkPublisher_new(Network *nn, int interval) {
+    NetworkPublisher pub = {0};
+    for (int i = 0; i < PUBLISHER_BUFFERS; i++) {
+        pub.buffers[i] = Network_clone(nn);
+        pub.versions[i] = 0;
+        atomic_init(&pub.readers[i], 0);
+    }
+    atomic_init(&pub.current, 0);
+    atomic_init(&pub.version, 0);
+    pub.interval = (interval > 0 ? interval : 1);
+    pub.steps = 0;
+    return pub;
+}
 
-    for (int i = 0; i < n; i++) {
-        int curStepIdx = stepIndexes[i];
+void NetworkPublisher_free(NetworkPublisher *pub) {
+    for (int i = 0; i < PUBLISHER_BUFFERS; i++) {
+        Network_free(&pub->buffers[i]);
+    }
+}
 
-        matrix_copy(&NETWORK_IN(nn), &steps[curStepIdx].state);
-        Network_forward(nn);
+// copies nn into a buffer no reader holds and publishes it
+// only ever called from the training thread
+// returns false (and skips this publish) if every other buffer is still pinned by readers
+bool NetworkPublisher_publish(NetworkPublisher *pub, Network *nn) {
+    if (!Network_same(&pub->buffers[0], nn))
+        return false;
 
-        for (int j = 0; j <= g->count; j++) {
-            matrix_clear(&g->layers[j]);
-        }
+    int current = atomic_load(&pub->current);
+    for (int i = 0; i < PUBLISHER_BUFFERS; i++) {
+        if (i == current || atomic_load(&pub->readers[i]) != 0)
+            continue;
 
-        for (int j = 0; j < NETWORK_OUT(g).cols; j++) {
-            if (steps[curStepIdx].action == j) {
-                MAT_AT(&NETWORK_OUT(g), 0, j) = 2 * (MAT_AT(&NETWORK_OUT(nn), 0, j) - MAT_AT(Qtargets, i, 0));
-            } else {
-                MAT_AT(&NETWORK_OUT(g), 0, j) = 0;
-            }
+        Network_copy(&pub->buffers[i], nn);
+        pub->versions[i] = atomic_load(&pub->version) + 1;
+        atomic_store(&pub->current, i);
+        atomic_store(&pub->version, pub->versions[i]);
+        return true;
+    }
+    return false;
+}
+
+// call once per training step, publishes every pub->interval steps
+bool NetworkPublisher_step(NetworkPublisher *pub, Network *nn) {
+    pub->steps++;
+    if (pub->steps % pub->interval != 0)
+        return false;
+    return NetworkPublisher_publish(pub, nn);
+}
+
+// pins the latest published snapshot, the returned Network must only be read
+// and handed back with NetworkPublisher_release
+Network *NetworkPublisher_acquire(NetworkPublisher *pub, unsigned long *version) {
+    for (;;) {
+        int current = atomic_load(&pub->current);
+        atomic_fetch_add(&pub->readers[current], 1);
+        // the writer may have moved on between the load and the pin,
+        // in that case the buffer could be getting overwritten so try again
+        if (atomic_load(&pub->current) == current) {
+            if (version)
+                *version = pub->versions[current];
+            return &pub->buffers[current];
         }
+        atomic_fetch_sub(&pub->readers[current], 1);
+    }
+}
 
-        for (int l = nn->count; l > 0; l--) {
-            for (int j = 0; j < nn->layers[l].cols; j++) {
-                float outputAhead = MAT_AT(&nn->layers[l], 0, j);
-                float derivativeAhead = MAT_AT(&g->layers[l], 0, j);
-                float activationDerivative = 1.0f;
-                if (nn->activations && nn->activations[l - 1].activationFunc) {
-                    float (*derivativeFunc)(float) = getActDerivative(nn->activations[l - 1].type);
-                    if (derivativeFunc) {
-                        activationDerivative = derivativeFunc(outputAhead);
-                    }
-                }
-                float fullDerivative = (derivativeAhead * activationDerivative);
-                MAT_AT(&g->biases[l - 1], 0, j) += (fullDerivative);
+void NetworkPublisher_release(NetworkPublisher *pub, Network *snapshot) {
+    int index = (int) (snapshot - pub->buffers);
+    if (index < 0 || index >= PUBLISHER_BUFFERS)
+        return;
+    atomic_fetch_sub(&pub->readers[index], 1);
+}
 
-                for (int k = 0; k < nn->layers[l - 1].cols; k++) {
-                    // j - weights matrix col
-                    // k = weights matrix row
-                    float prevInput = MAT_AT(&nn->layers[l - 1], 0, k);
-                    MAT_AT(&g->weights[l - 1], k, j) += (fullDerivative * prevInput);
+// copies the latest snapshot into dest if it is newer than `seen`
+// returns the version dest now holds
+unsigned long NetworkPublisher_read(NetworkPublisher *pub, Network *dest, unsigned long seen) {
+    if (atomic_load(&pub->version) == seen)
+        return seen;
+
+    unsigned long version;
+    Network *snapshot = NetworkPublisher_acquire(pub, &version);
+    if (version != seen)
+        Network_copy(dest, snapshot);
+    NetworkPublisher_release(pub, snapshot);
+    return version;
+}
 
-                    float prevWeight = MAT_AT(&nn->weights[l - 1], k, j);
-                    MAT_AT(&g->layers[l - 1], 0, k) += (fullDerivative * prevWeight);
-                }
+// SharedNetwork hosts one model for every serving process on the machine. A loader creates a named
+// segment from a Network and later publishes new weights into it, any number of processes attach and
+// run whatever SharedNetwork_acquire hands them. Slots are pinned and rotated exactly like the buffers
+// of a NetworkPublisher, only the counters live in the segment: a process that dies holding a pin keeps
+// that one slot out of rotation, the other two still rotate. Only the creating process publishes.
+
+const char sharedNetworkMagic[] = "mlsh";
+
+// the parameter matrices of layer i in the order they are stored: weights, biases, recurrent
+int network_layer_params(Network *nn, int i, Matrix **params) {
+    int n = 0;
+    params[n++] = &nn->weights[i];
+    params[n++] = &nn->biases[i];
+    if (Network_layer_type(nn, i) == LAYER_GRU)
+        params[n++] = &nn->specs[i].recurrent;
+    return n;
+}
+
+// floats of parameters in nn, with params set the parameter matrices of nn are pointed into it
+size_t network_bind_params(Network *nn, float *params) {
+    size_t total = 0;
+    for (int i = 0; i < nn->count; i++) {
+        Matrix *owned[3];
+        int n = network_layer_params(nn, i, owned);
+        for (int j = 0; j < n; j++) {
+            if (params) {
+                free(owned[j]->data);
+                owned[j]->data = params + total;
             }
+            total += (size_t) owned[j]->rows * owned[j]->cols;
         }
     }
+    return total;
+}
 
-    for (int i = 0; i < g->count; i++) {
-        Matrix *curWeights = &g->weights[i];
-        for (int j = 0; j < curWeights->rows; j++) {
-            for (int k = 0; k < curWeights->cols; k++) {
-                MAT_AT(curWeights, j, k) /= n;
+// copies the parameters of nn into dest in network_layer_params order, returns floats written
+size_t network_pack_params(Network *nn, float *dest) {
+    size_t total = 0;
+    for (int i = 0; i < nn->count; i++) {
+        Matrix *owned[3];
+        int n = network_layer_params(nn, i, owned);
+        for (int j = 0; j < n; j++) {
+            for (int r = 0; r < owned[j]->rows; r++) {
+                memcpy(&dest[total], &MAT_AT(owned[j], r, 0), sizeof(float) * owned[j]->cols);
+                total += owned[j]->cols;
             }
         }
-
-        Matrix *curBiases = &g->biases[i];
-        for (int k = 0; k < curBiases->cols; k++) {
-            MAT_AT(curBiases, 0, k) /= n;
-        }
     }
+    return total;
 }
 
-void calc_QTargets(Network *TargetNN, Matrix *QTargets, Step *steps, int *indexes) {
-    float gamma = 0.99;
-    for (int i = 0; i < QTargets->rows; i++) {
-        int curRandIdx = indexes[i];
-        if (steps[curRandIdx].death == false) {
-            matrix_copy(&NETWORK_IN(TargetNN), &steps[curRandIdx + 1].state);
-            Network_forward(TargetNN);
-
-            float maxQ = MAT_AT(&NETWORK_OUT(TargetNN), 0, 0);
-            for (int j = 1; j < NETWORK_OUT(TargetNN).cols; j++) {
-                if (MAT_AT(&NETWORK_OUT(TargetNN), 0, j) > maxQ) {
-                    maxQ = MAT_AT(&NETWORK_OUT(TargetNN), 0, j);
-                }
+// inverse of network_pack_params, returns floats read
+size_t network_unpack_params(Network *nn, float *src) {
+    size_t total = 0;
+    for (int i = 0; i < nn->count; i++) {
+        Matrix *owned[3];
+        int n = network_layer_params(nn, i, owned);
+        for (int j = 0; j < n; j++) {
+            for (int r = 0; r < owned[j]->rows; r++) {
+                memcpy(&MAT_AT(owned[j], r, 0), &src[total], sizeof(float) * owned[j]->cols);
+                total += owned[j]->cols;
             }
-            MAT_AT(QTargets, i, 0) = steps[curRandIdx].reward + (gamma * maxQ);
-        } else // if (steps[curRandIdx]->death == true)
-        {
-            MAT_AT(QTargets, i, 0) = steps[curRandIdx].reward;
         }
     }
+    return total;
 }
 
-void Network_policy_gradient_backprop(Network *nn, Network *g, Step *steps, int stepAmount) {
-    if (!steps)
-        return;
-    if (!matrix_same(&NETWORK_IN(nn), &steps[0].state))
-        return;
-    if (!Network_same(nn, g))
-        return;
-    int n = stepAmount; // amount of steps
-
-    Network_clear(g);
+// shm_open wants exactly one leading slash
+void sharednetwork_path(const char *name, char *path, size_t size) {
+#if defined(_WIN32) || defined(_WIN64)
+    snprintf(path, size, "%s", name);
+#else
+    snprintf(path, size, "%s%s", (name[0] == '/' ? "" : "/"), name);
+#endif
+}
 
-    for (int i = 0; i < n; i++) {
-        matrix_copy(&NETWORK_IN(nn), &steps[i].state);
+// ints stored after the header for nn
+size_t sharednetwork_ints(int count, bool layered) {
+    return (size_t) (count + 1) + count + (layered ? (size_t) count * LAYER_DESCRIPTOR_INTS : 0);
+}
 
-        Network_forward(nn);
+// builds this process's Network over every slot of the mapped segment
+bool sharednetwork_views(SharedNetwork *shared) {
+    SharedNetworkHeader *header = shared->header;
+    int count = header->count;
+    int *arch = (int *) (header + 1);
+    int *types = arch + count + 1;
+    int *descriptors = types + count;
+    for (int i = 0; i <= count; i++) {
+        if (arch[i] <= 0)
+            return false;
+    }
 
-        for (int j = 0; j <= g->count; j++) {
-            matrix_clear(&g->layers[j]);
+    ActivationType *activations = NULL;
+    if (header->hasActivations) {
+        activations = malloc(sizeof(*activations) * count);
+        for (int i = 0; i < count; i++) {
+            activations[i] = types[i];
+        }
+    }
+    Layer *specs = NULL;
+    bool valid = true;
+    if (header->layered) {
+        specs = calloc(sizeof(*specs), count);
+        for (int i = 0; valid && i < count; i++) {
+            valid = layer_from_descriptor(&specs[i], &descriptors[i * LAYER_DESCRIPTOR_INTS], arch[i], arch[i + 1]);
+        }
+    }
+    for (int slot = 0; valid && slot < PUBLISHER_BUFFERS; slot++) {
+        Network *view = &shared->views[slot];
+        *view = network_new(arch, count + 1, activations, specs);
+        if (network_bind_params(view, NULL) * sizeof(float) > header->slotBytes) {
+            valid = false;
+            break;
         }
+        network_bind_params(view, (float *) ((char *) shared->mapping + header->headerBytes + slot * header->slotBytes));
+    }
+    free(activations);
+    free(specs);
+    return valid;
+}
 
-        for (int j = 0; j < NETWORK_OUT(nn).cols; j++) {
-            float P_k = MAT_AT(&NETWORK_OUT(nn), 0, j);
-            MAT_AT(&NETWORK_OUT(g), 0, j) = (P_k - (steps[i].action == j ? 1 : 0)) * steps[i].reward;
+// checks a freshly mapped segment and makes its parameter pages read-only unless this process owns it
+bool sharednetwork_open(SharedNetwork *shared) {
+    SharedNetworkHeader *header = shared->mapping;
+    shared->header = header;
+    unsigned long magicLen = sizeof(sharedNetworkMagic) - 1;
+    if (shared->size < sizeof(*header) || strncmp(header->magic, sharedNetworkMagic, magicLen) != 0 ||
+        header->count <= 0 || header->count > 1 << 16) {
+        fprintf(stderr, "Invalid shared network\n");
+        return false;
+    }
+    size_t ints = sharednetwork_ints(header->count, header->layered);
+    if (header->headerBytes < sizeof(*header) + ints * sizeof(int) || header->headerBytes % SHARED_NETWORK_ALIGN != 0 ||
+        shared->size < header->headerBytes + PUBLISHER_BUFFERS * header->slotBytes) {
+        fprintf(stderr, "Invalid shared network\n");
+        return false;
+    }
+    if (atomic_load(&header->generation) == 0) {
+        fprintf(stderr, "Shared network is still being created\n");
+        return false;
+    }
+    if (!shared->owner) {
+        void *slots = (char *) shared->mapping + header->headerBytes;
+        size_t bytes = shared->size - header->headerBytes;
+#if defined(_WIN32) || defined(_WIN64)
+        DWORD previous;
+        bool protectedPages = VirtualProtect(slots, bytes, PAGE_READONLY, &previous) != 0;
+#else
+        bool protectedPages = (mprotect(slots, bytes, PROT_READ) == 0);
+#endif
+        if (!protectedPages) {
+            fprintf(stderr, "Shared network parameters could not be made read-only\n");
+            return false;
         }
+    }
+    if (!sharednetwork_views(shared)) {
+        fprintf(stderr, "Invalid shared network\n");
+        return false;
+    }
+    return true;
+}
 
-        for (int l = nn->count; l > 0; l--) {
-            for (int j = 0; j < nn->layers[l].cols; j++) {
-                float outputAhead = MAT_AT(&nn->layers[l], 0, j);
-                float derivativeAhead = MAT_AT(&g->layers[l], 0, j);
-                float activationDerivative = 1.0f;
-                if (nn->activations && nn->activations[l - 1].activationFunc) {
-                    float (*derivativeFunc)(float) = getActDerivative(nn->activations[l - 1].type);
-                    if (derivativeFunc) {
-                        activationDerivative = derivativeFunc(outputAhead);
-                    }
-                }
-                float fullDerivative = (derivativeAhead * activationDerivative);
-                MAT_AT(&g->biases[l - 1], 0, j) += (fullDerivative);
+// creates the segment `name` sized for nn's architecture and publishes nn as generation 1
+// fails if the name is taken, SharedNetwork_unlink the old one first
+// on Windows the segment disappears with the last process that has it open
+bool SharedNetwork_create(SharedNetwork *shared, const char *name, Network *nn) {
+    memset(shared, 0, sizeof(*shared));
+    size_t ints = sharednetwork_ints(nn->count, nn->specs != NULL);
+    size_t headerBytes = sizeof(SharedNetworkHeader) + ints * sizeof(int);
+    headerBytes = (headerBytes + SHARED_NETWORK_ALIGN - 1) / SHARED_NETWORK_ALIGN * SHARED_NETWORK_ALIGN;
+    // slots start on their own cache lines
+    size_t slotBytes = (network_bind_params(nn, NULL) * sizeof(float) + 63) / 64 * 64;
+    shared->size = headerBytes + PUBLISHER_BUFFERS * slotBytes;
+    shared->owner = true;
+
+    char path[256];
+    sharednetwork_path(name, path, sizeof(path));
+#if defined(_WIN32) || defined(_WIN64)
+    shared->map = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD) ((unsigned long long) shared->size >> 32),
+                                     (DWORD) (shared->size & 0xffffffff), path);
+    if (shared->map && GetLastError() == ERROR_ALREADY_EXISTS) {
+        CloseHandle(shared->map);
+        shared->map = NULL;
+        fprintf(stderr, "Shared network %s already exists\n", name);
+        return false;
+    }
+    shared->mapping = (shared->map ? MapViewOfFile(shared->map, FILE_MAP_ALL_ACCESS, 0, 0, 0) : NULL);
+    if (!shared->mapping) {
+        fprintf(stderr, "Shared network %s could not be created\n", name);
+        SharedNetwork_close(shared);
+        return false;
+    }
+#else
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0660);
+    if (fd < 0) {
+        fprintf(stderr, "Shared network %s %s\n", name, (errno == EEXIST ? "already exists" : "could not be created"));
+        return false;
+    }
+    if (ftruncate(fd, (off_t) shared->size) != 0) {
+        fprintf(stderr, "Shared network %s could not be created\n", name);
+        close(fd);
+        shm_unlink(path);
+        return false;
+    }
+    shared->mapping = mmap(NULL, shared->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared->mapping == MAP_FAILED) {
+        shared->mapping = NULL;
+        fprintf(stderr, "Shared network %s could not be mapped\n", name);
+        shm_unlink(path);
+        return false;
+    }
+#endif
 
-                for (int k = 0; k < nn->layers[l - 1].cols; k++) {
-                    // j - weights matrix col
-                    // k = weights matrix row
-                    float prevInput = MAT_AT(&nn->layers[l - 1], 0, k);
-                    MAT_AT(&g->weights[l - 1], k, j) += (fullDerivative * prevInput);
+    // the segment starts zeroed, generation 0 keeps attaching processes out until slot 0 is written
+    SharedNetworkHeader *header = shared->mapping;
+    memcpy(header->magic, sharedNetworkMagic, sizeof(header->magic));
+    header->count = nn->count;
+    header->layered = (nn->specs != NULL);
+    header->hasActivations = (nn->activations != NULL);
+    header->headerBytes = headerBytes;
+    header->slotBytes = slotBytes;
+    for (int i = 0; i < PUBLISHER_BUFFERS; i++) {
+        header->generations[i] = 0;
+        atomic_init(&header->readers[i], 0);
+    }
+    atomic_init(&header->current, 0);
+    atomic_init(&header->generation, 0);
 
-                    float prevWeight = MAT_AT(&nn->weights[l - 1], k, j);
-                    MAT_AT(&g->layers[l - 1], 0, k) += (fullDerivative * prevWeight);
-                }
-            }
-        }
+    int *arch = Network_getArch(nn);
+    int *fields = (int *) (header + 1);
+    memcpy(fields, arch, sizeof(*arch) * (nn->count + 1));
+    free(arch);
+    for (int i = 0; i < nn->count; i++) {
+        fields[nn->count + 1 + i] = (nn->activations ? (int) nn->activations[i].type : 0);
+        if (nn->specs)
+            layer_descriptor(&nn->specs[i], &fields[2 * nn->count + 1 + i * LAYER_DESCRIPTOR_INTS]);
     }
+    shared->header = header;
+    if (!sharednetwork_views(shared)) {
+        fprintf(stderr, "Shared network %s could not be created\n", name);
+        SharedNetwork_close(shared);
+        SharedNetwork_unlink(name);
+        return false;
+    }
+    Network_copy(&shared->views[0], nn);
+    header->generations[0] = 1;
+    atomic_store(&header->generation, 1);
+    return true;
+}
 
-    for (int i = 0; i < g->count; i++) {
-        Matrix *curWeights = &g->weights[i];
-        for (int j = 0; j < curWeights->rows; j++) {
-            for (int k = 0; k < curWeights->cols; k++) {
-                MAT_AT(curWeights, j, k) /= n;
-            }
+// maps an existing segment, the parameters of every view are read-only in this process
+bool SharedNetwork_attach(SharedNetwork *shared, const char *name) {
+    memset(shared, 0, sizeof(*shared));
+    char path[256];
+    sharednetwork_path(name, path, sizeof(path));
+#if defined(_WIN32) || defined(_WIN64)
+    shared->map = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, path);
+    shared->mapping = (shared->map ? MapViewOfFile(shared->map, FILE_MAP_ALL_ACCESS, 0, 0, 0) : NULL);
+    if (!shared->mapping) {
+        fprintf(stderr, "Shared network %s could not be opened\n", name);
+        SharedNetwork_close(shared);
+        return false;
+    }
+    MEMORY_BASIC_INFORMATION info;
+    VirtualQuery(shared->mapping, &info, sizeof(info));
+    shared->size = info.RegionSize;
+#else
+    int fd = shm_open(path, O_RDWR, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Shared network %s could not be opened\n", name);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    shared->size = (size_t) st.st_size;
+    shared->mapping = mmap(NULL, shared->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared->mapping == MAP_FAILED) {
+        shared->mapping = NULL;
+        fprintf(stderr, "Shared network %s could not be mapped\n", name);
+        return false;
+    }
+#endif
+    if (!sharednetwork_open(shared)) {
+        SharedNetwork_close(shared);
+        return false;
+    }
+    return true;
+}
+
+// unmaps the segment, it lives on for the other processes until SharedNetwork_unlink
+// every Network handed out by SharedNetwork_acquire must be released first
+void SharedNetwork_close(SharedNetwork *shared) {
+    for (int slot = 0; slot < PUBLISHER_BUFFERS; slot++) {
+        Network *view = &shared->views[slot];
+        for (int i = 0; i < view->count; i++) {
+            view->weights[i].data = NULL;
+            view->biases[i].data = NULL;
+            if (Network_layer_type(view, i) == LAYER_GRU)
+                view->specs[i].recurrent.data = NULL;
         }
+        Network_free(view);
+    }
+#if defined(_WIN32) || defined(_WIN64)
+    if (shared->mapping)
+        UnmapViewOfFile(shared->mapping);
+    if (shared->map)
+        CloseHandle(shared->map);
+    shared->map = NULL;
+#else
+    if (shared->mapping)
+        munmap(shared->mapping, shared->size);
+#endif
+    shared->mapping = NULL;
+    shared->header = NULL;
+    shared->size = 0;
+}
 
-        Matrix *curBiases = &g->biases[i];
-        for (int k = 0; k < curBiases->cols; k++) {
-            MAT_AT(curBiases, 0, k) /= n;
+// removes the name, processes that have the segment mapped keep using it
+bool SharedNetwork_unlink(const char *name) {
+#if defined(_WIN32) || defined(_WIN64)
+    (void) name;
+    return true;
+#else
+    char path[256];
+    sharednetwork_path(name, path, sizeof(path));
+    return shm_unlink(path) == 0;
+#endif
+}
+
+// a slot that is neither published nor pinned by any process, -1 if there is none
+int sharednetwork_claim(SharedNetwork *shared) {
+    if (!shared->owner) {
+        fprintf(stderr, "Only the process that created a shared network can publish to it\n");
+        return -1;
+    }
+    int current = atomic_load(&shared->header->current);
+    for (int i = 0; i < PUBLISHER_BUFFERS; i++) {
+        if (i != current && atomic_load(&shared->header->readers[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+void sharednetwork_flip(SharedNetwork *shared, int slot) {
+    SharedNetworkHeader *header = shared->header;
+    header->generations[slot] = atomic_load(&header->generation) + 1;
+    atomic_store(&header->current, slot);
+    atomic_store(&header->generation, header->generations[slot]);
+}
+
+// copies nn into a free slot and makes it the next generation for every attached process
+// returns false (and skips this publish) if every other slot is still pinned
+bool SharedNetwork_publish(SharedNetwork *shared, Network *nn) {
+    if (!Network_same(&shared->views[0], nn))
+        return false;
+    int slot = sharednetwork_claim(shared);
+    if (slot < 0)
+        return false;
+    Network_copy(&shared->views[slot], nn);
+    sharednetwork_flip(shared, slot);
+    return true;
+}
+
+// Network_load straight into a free slot, a file that does not load leaves the live generation alone
+bool SharedNetwork_publish_file(SharedNetwork *shared, const char *fileName) {
+    int slot = sharednetwork_claim(shared);
+    if (slot < 0 || !Network_load(&shared->views[slot], fileName))
+        return false;
+    sharednetwork_flip(shared, slot);
+    return true;
+}
+
+// latest published generation, cheap enough to poll
+unsigned long SharedNetwork_generation(SharedNetwork *shared) {
+    return atomic_load(&shared->header->generation);
+}
+
+// pins the latest generation, the returned Network must only be read
+// and handed back with SharedNetwork_release
+Network *SharedNetwork_acquire(SharedNetwork *shared, unsigned long *generation) {
+    SharedNetworkHeader *header = shared->header;
+    for (;;) {
+        int current = atomic_load(&header->current);
+        atomic_fetch_add(&header->readers[current], 1);
+        // see NetworkPublisher_acquire, the slot may have been claimed before the pin landed
+        if (atomic_load(&header->current) == current) {
+            if (generation)
+                *generation = header->generations[current];
+            return &shared->views[current];
         }
+        atomic_fetch_sub(&header->readers[current], 1);
     }
 }
 
-void Network_gradient_descent(Network *nn, Network *g, float rate) {
-    if (!Network_same(nn, g))
+void SharedNetwork_release(SharedNetwork *shared, Network *snapshot) {
+    int index = (int) (snapshot - shared->views);
+    if (index < 0 || index >= PUBLISHER_BUFFERS)
         return;
+    atomic_fetch_sub(&shared->header->readers[index], 1);
+}
 
-    for (int i = 0; i < nn->count; i++) {
-        Matrix *curWeights = &nn->weights[i];
-        Matrix *curGradWeights = &g->weights[i];
-        for (int j = 0; j < curWeights->rows; j++) {
-            for (int k = 0; k < curWeights->cols; k++) {
-                MAT_AT(curWeights, j, k) -= rate * MAT_AT(curGradWeights, j, k);
+// Checkpointer files: <path>.ckpt holds the last full checkpoint and <path>.delta.ckpt the latest
+// delta against it, each written to a .tmp file, synced and renamed over the old one, so a crash
+// at any point leaves the previous checkpoint intact. A delta whose base is not the full checkpoint
+// on disk is ignored, it has to name the full checkpoint's sequence and payload hash.
+//
+// file layout: "mlck", kind, sequence, base sequence, base hash (uint64), layoutLen and layout (ints),
+// float count of every network (uint64), payload size (uint64), payload, hash of the payload (uint64)
+#define CHECKPOINT_FIELDS 4
+const char checkpointHeader[] = "mlck";
+
+// FNV-1a over 8 byte words, only guards against torn or corrupted files
+uint64_t ml_hash(const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, &bytes[i], sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// pushes the written data of file to the disk
+bool ml_sync_file(FILE *file) {
+    if (fflush(file) != 0)
+        return false;
+#if defined(_WIN32) || defined(_WIN64)
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// makes renames and removals in the directory holding path durable
+bool ml_sync_dir(const char *path) {
+#if defined(_WIN32) || defined(_WIN64)
+    (void) path;
+    return true;
+#else
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash)
+        *(slash == dir ? slash + 1 : slash) = '\0';
+    else
+        snprintf(dir, sizeof(dir), ".");
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool ok = (fsync(fd) == 0);
+    close(fd);
+    return ok;
+#endif
+}
+
+// atomically replaces dest with src and makes the rename itself durable
+bool ml_replace_file(const char *src, const char *dest) {
+#if defined(_WIN32) || defined(_WIN64)
+    return MoveFileExA(src, dest, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    if (rename(src, dest) != 0)
+        return false;
+    ml_sync_dir(dest);
+    return true;
+#endif
+}
+
+// zero run of the delta encoding: a 0 byte followed by the run length, 7 bits per byte
+// returns the new position, or 0 if it does not fit
+size_t checkpoint_put_run(unsigned char *out, size_t pos, size_t capacity, size_t run) {
+    if (pos >= capacity)
+        return 0;
+    out[pos++] = 0;
+    do {
+        if (pos >= capacity)
+            return 0;
+        out[pos++] = (unsigned char) ((run & 0x7f) | (run > 0x7f ? 0x80 : 0));
+        run >>= 7;
+    } while (run);
+    return pos;
+}
+
+// XOR of current and base split into byte planes, most significant first, with runs of zero bytes
+// collapsed. Parameters that did not move cost nothing and small updates leave the sign and
+// exponent plane mostly zero. Returns the encoded size, 0 if it would not fit in capacity bytes
+size_t checkpoint_encode(float *current, float *base, size_t n, unsigned char *out, size_t capacity) {
+    size_t pos = 0;
+    size_t run = 0;
+    for (int plane = 3; plane >= 0; plane--) {
+        for (size_t i = 0; i < n; i++) {
+            uint32_t a, b;
+            memcpy(&a, &current[i], sizeof(a));
+            memcpy(&b, &base[i], sizeof(b));
+            unsigned char byte = (unsigned char) ((a ^ b) >> (8 * plane));
+            if (byte == 0) {
+                run++;
+                continue;
             }
+            if (run) {
+                pos = checkpoint_put_run(out, pos, capacity, run);
+                if (!pos)
+                    return 0;
+                run = 0;
+            }
+            if (pos >= capacity)
+                return 0;
+            out[pos++] = byte;
         }
+    }
+    if (run)
+        pos = checkpoint_put_run(out, pos, capacity, run);
+    return pos;
+}
 
-        Matrix *curBiases = &nn->weights[i];
-        Matrix *curGradBiases = &g->weights[i];
-        for (int k = 0; k < curBiases->cols; k++) {
-            MAT_AT(curBiases, 0, k) -= rate * MAT_AT(curGradBiases, 0, k);
+// inverse of checkpoint_encode into dest, false if the encoding does not describe n floats
+bool checkpoint_decode(unsigned char *in, size_t size, float *base, float *dest, size_t n) {
+    memcpy(dest, base, sizeof(*dest) * n);
+    size_t pos = 0;
+    size_t run = 0;
+    for (int plane = 3; plane >= 0; plane--) {
+        for (size_t i = 0; i < n; i++) {
+            if (run) {
+                run--;
+                continue;
+            }
+            if (pos >= size)
+                return false;
+            unsigned char byte = in[pos++];
+            if (byte == 0) {
+                int shift = 0;
+                do {
+                    if (pos >= size || shift > 56)
+                        return false;
+                    run |= (size_t) (in[pos] & 0x7f) << shift;
+                    shift += 7;
+                } while (in[pos++] & 0x80);
+                if (run == 0)
+                    return false;
+                run--;
+                continue;
+            }
+            uint32_t bits;
+            memcpy(&bits, &dest[i], sizeof(bits));
+            bits ^= (uint32_t) byte << (8 * plane);
+            memcpy(&dest[i], &bits, sizeof(bits));
         }
     }
+    return run == 0 && pos == size;
 }
 
-void Network_gradient_ascent(Network *nn, Network *g, float rate) {
-    if (!Network_same(nn, g))
-        return;
+// writes one checkpoint file next to its final name and renames it into place
+bool checkpointer_write_file(Checkpointer *cp, const char *path, uint64_t *fields, void *payload, size_t bytes) {
+    char temp[4200];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE *file = fopen(temp, "wb");
+    if (!file) {
+        fprintf(stderr, "Checkpoint %s could not be opened\n", temp);
+        return false;
+    }
+    uint64_t size = bytes;
+    uint64_t hash = ml_hash(payload, bytes);
+    fwrite(checkpointHeader, sizeof(char), sizeof(checkpointHeader) - 1, file);
+    fwrite(fields, sizeof(*fields), CHECKPOINT_FIELDS, file);
+    fwrite(&cp->layoutLen, sizeof(cp->layoutLen), 1, file);
+    fwrite(cp->layout, sizeof(*cp->layout), cp->layoutLen, file);
+    for (int i = 0; i < cp->count; i++) {
+        uint64_t floats = cp->sizes[i];
+        fwrite(&floats, sizeof(floats), 1, file);
+    }
+    fwrite(&size, sizeof(size), 1, file);
+    fwrite(payload, 1, bytes, file);
+    fwrite(&hash, sizeof(hash), 1, file);
+    bool ok = !ferror(file) && ml_sync_file(file);
+    ok = (fclose(file) == 0) && ok;
+    ok = ok && ml_replace_file(temp, path);
+    if (!ok) {
+        fprintf(stderr, "Checkpoint %s could not be written\n", path);
+        remove(temp);
+    }
+    return ok;
+}
 
-    // this is in here just in case because i did copy paste the new part
+// kind, sequence, base sequence and base hash of a checkpoint file, false if there is none
+bool checkpoint_read_fields(const char *path, uint64_t *fields) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+    unsigned long headerLen = sizeof(checkpointHeader) - 1;
+    char header[sizeof(checkpointHeader) - 1];
+    bool valid = fread(header, sizeof(char), headerLen, file) == headerLen &&
+                 strncmp(header, checkpointHeader, headerLen) == 0 &&
+                 fread(fields, sizeof(*fields), CHECKPOINT_FIELDS, file) == CHECKPOINT_FIELDS;
+    fclose(file);
+    return valid;
+}
 
-    // for (int i = 0; i < nn->count; i++) {
-    //     for (int j = 0; j < nn->weights[i]->rows; j++) {
-    //         for (int k = 0; k < nn->weights[i]->cols; k++) {
-    //             MAT_AT(nn->weights[i], j, k) += rate * MAT_AT(g->weights[i], j, k);
-    //         }
-    //     }
+// reads and verifies a checkpoint file written for cp's networks, fields gets its CHECKPOINT_FIELDS
+// and hash the payload hash; returns the malloc'd payload, NULL if the file is missing or does not fit
+unsigned char *checkpointer_read_file(Checkpointer *cp, const char *path, uint64_t *fields, uint64_t *hash, size_t *bytes) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    unsigned long headerLen = sizeof(checkpointHeader) - 1;
+    char header[sizeof(checkpointHeader) - 1];
+    int layoutLen = 0;
+    bool valid = fread(header, sizeof(char), headerLen, file) == headerLen &&
+                 strncmp(header, checkpointHeader, headerLen) == 0 &&
+                 fread(fields, sizeof(*fields), CHECKPOINT_FIELDS, file) == CHECKPOINT_FIELDS &&
+                 fread(&layoutLen, sizeof(layoutLen), 1, file) == 1 && layoutLen == cp->layoutLen;
+    for (int i = 0; valid && i < cp->layoutLen; i++) {
+        int value;
+        valid = fread(&value, sizeof(value), 1, file) == 1 && value == cp->layout[i];
+    }
+    for (int i = 0; valid && i < cp->count; i++) {
+        uint64_t floats;
+        valid = fread(&floats, sizeof(floats), 1, file) == 1 && floats == cp->sizes[i];
+    }
+    uint64_t size = 0;
+    valid = valid && fread(&size, sizeof(size), 1, file) == 1 && size <= cp->paramCount * sizeof(float);
+    unsigned char *payload = (valid ? malloc(size ? size : 1) : NULL);
+    *hash = 0;
+    valid = valid && fread(payload, 1, size, file) == size && fread(hash, sizeof(*hash), 1, file) == 1 &&
+            *hash == ml_hash(payload, size);
+    fclose(file);
+    if (!valid) {
+        fprintf(stderr, "Invalid checkpoint %s\n", path);
+        free(payload);
+        return NULL;
+    }
+    *bytes = size;
+    return payload;
+}
 
-    //     for (int k = 0; k < nn->biases[i]->cols; k++) {
-    //         MAT_AT(nn->biases[i], 0, k) += rate * MAT_AT(g->biases[i], 0, k);
-    //     }
-    // }
+// writes one snapshot, as a delta when it is time for one and it comes out smaller than the parameters
+bool checkpointer_write(Checkpointer *cp, CheckpointSnapshot *snapshot) {
+    size_t raw = cp->paramCount * sizeof(float);
+    bool full = (cp->baseSequence == 0 || cp->fullEvery <= 1 || cp->sinceFull + 1 >= cp->fullEvery);
+    size_t bytes = 0;
+    if (!full) {
+        bytes = checkpoint_encode(snapshot->params, cp->base, cp->paramCount, cp->encoded, raw);
+        full = (bytes == 0);
+    }
 
-    for (int i = 0; i < nn->count; i++) {
-        Matrix *curWeights = &nn->weights[i];
-        Matrix *curGradWeights = &g->weights[i];
-        for (int j = 0; j < curWeights->rows; j++) {
-            for (int k = 0; k < curWeights->cols; k++) {
-                MAT_AT(curWeights, j, k) += rate * MAT_AT(curGradWeights, j, k);
-            }
+    char path[4200];
+    snprintf(path, sizeof(path), "%s%s", cp->path, (full ? ".ckpt" : ".delta.ckpt"));
+    uint64_t hash = (full ? ml_hash(snapshot->params, raw) : cp->baseHash);
+    uint64_t fields[CHECKPOINT_FIELDS] = {(full ? CHECKPOINT_FULL : CHECKPOINT_DELTA), snapshot->sequence,
+                                          (full ? snapshot->sequence : cp->baseSequence), hash};
+    if (!checkpointer_write_file(cp, path, fields, (full ? (void *) snapshot->params : (void *) cp->encoded),
+                                 (full ? raw : bytes)))
+        return false;
+
+    if (full) {
+        memcpy(cp->base, snapshot->params, raw);
+        cp->baseSequence = snapshot->sequence;
+        cp->baseHash = hash;
+        cp->sinceFull = 0;
+        // the old delta names another base hash, restoring skips it even if this removal is lost
+        snprintf(path, sizeof(path), "%s.delta.ckpt", cp->path);
+        if (remove(path) == 0)
+            ml_sync_dir(path);
+    } else {
+        cp->sinceFull++;
+    }
+    return true;
+}
+
+void *checkpointer_worker(void *arg) {
+    Checkpointer *cp = arg;
+    pthread_mutex_lock(&cp->lock);
+    for (;;) {
+        while (cp->pending < 0 && !cp->stop) {
+            pthread_cond_wait(&cp->wake, &cp->lock);
         }
+        // a pending snapshot is still written when stopping
+        if (cp->pending < 0)
+            break;
+        cp->writing = cp->pending;
+        cp->pending = -1;
+        CheckpointSnapshot *snapshot = &cp->snapshots[cp->writing];
+        pthread_mutex_unlock(&cp->lock);
+
+        bool ok = checkpointer_write(cp, snapshot);
+
+        pthread_mutex_lock(&cp->lock);
+        if (ok)
+            cp->written++;
+        else
+            cp->failed++;
+        cp->writing = -1;
+        pthread_cond_broadcast(&cp->idle);
+    }
+    pthread_mutex_unlock(&cp->lock);
+    return NULL;
+}
 
-        Matrix *curBiases = &nn->weights[i];
-        Matrix *curGradBiases = &g->weights[i];
-        for (int k = 0; k < curBiases->cols; k++) {
-            MAT_AT(curBiases, 0, k) += rate * MAT_AT(curGradBiases, 0, k);
+// checkpoints networks[0 .. count) together under `path` (.ckpt / .delta.ckpt are appended),
+// every fullEvery-th checkpoint is full and the ones in between are deltas, fullEvery <= 1 writes
+// only full ones; the networks must keep their architecture for the Checkpointer's lifetime
+Checkpointer *Checkpointer_new(Network **networks, int count, const char *path, int fullEvery) {
+    Checkpointer *cp = calloc(1, sizeof(*cp));
+    cp->count = count;
+    cp->networks = malloc(sizeof(*cp->networks) * count);
+    memcpy(cp->networks, networks, sizeof(*cp->networks) * count);
+    cp->sizes = malloc(sizeof(*cp->sizes) * count);
+    cp->layoutLen = 1;
+    for (int i = 0; i < count; i++) {
+        cp->sizes[i] = network_bind_params(networks[i], NULL);
+        cp->paramCount += cp->sizes[i];
+        cp->layoutLen += networks[i]->count + 2;
+    }
+    cp->layout = malloc(sizeof(*cp->layout) * cp->layoutLen);
+    cp->layout[0] = count;
+    for (int i = 0, at = 1; i < count; i++) {
+        int *arch = Network_getArch(networks[i]);
+        cp->layout[at++] = networks[i]->count + 1;
+        memcpy(&cp->layout[at], arch, sizeof(*arch) * (networks[i]->count + 1));
+        at += networks[i]->count + 1;
+        free(arch);
+    }
+    cp->fullEvery = fullEvery;
+    snprintf(cp->path, sizeof(cp->path), "%s", path);
+    for (int i = 0; i < 2; i++) {
+        cp->snapshots[i].params = ml_calloc(cp->paramCount ? cp->paramCount : 1, sizeof(float));
+    }
+    cp->base = ml_calloc(cp->paramCount ? cp->paramCount : 1, sizeof(float));
+    cp->encoded = malloc(cp->paramCount * sizeof(float) + 1);
+    cp->writing = -1;
+    cp->pending = -1;
+    // keep counting from whatever an earlier run left under path, restored or not
+    const char *suffixes[] = {".ckpt", ".delta.ckpt"};
+    for (int i = 0; i < (int) ARR_LEN(suffixes); i++) {
+        char file[4200];
+        uint64_t fields[CHECKPOINT_FIELDS];
+        snprintf(file, sizeof(file), "%s%s", cp->path, suffixes[i]);
+        if (checkpoint_read_fields(file, fields) && fields[1] > cp->sequence)
+            cp->sequence = fields[1];
+    }
+    pthread_mutex_init(&cp->lock, NULL);
+    pthread_cond_init(&cp->wake, NULL);
+    pthread_cond_init(&cp->idle, NULL);
+    pthread_create(&cp->writer, NULL, checkpointer_worker, cp);
+    return cp;
+}
+
+// writes whatever is still pending before stopping the writer
+void Checkpointer_free(Checkpointer *cp) {
+    pthread_mutex_lock(&cp->lock);
+    cp->stop = true;
+    pthread_cond_signal(&cp->wake);
+    pthread_mutex_unlock(&cp->lock);
+    pthread_join(cp->writer, NULL);
+    pthread_mutex_destroy(&cp->lock);
+    pthread_cond_destroy(&cp->wake);
+    pthread_cond_destroy(&cp->idle);
+    for (int i = 0; i < 2; i++) {
+        free(cp->snapshots[i].params);
+    }
+    free(cp->base);
+    free(cp->encoded);
+    free(cp->layout);
+    free(cp->sizes);
+    free(cp->networks);
+    free(cp);
+}
+
+// copies the current parameters and returns, the writer thread takes it from there
+// a snapshot the writer has not started on yet is replaced by this newer one
+// call from the thread that updates the networks, between updates
+void Checkpointer_save(Checkpointer *cp) {
+    pthread_mutex_lock(&cp->lock);
+    int slot = (cp->writing == 0 ? 1 : 0);
+    cp->pending = -1;
+    unsigned long sequence = ++cp->sequence;
+    pthread_mutex_unlock(&cp->lock);
+
+    float *dest = cp->snapshots[slot].params;
+    for (int i = 0; i < cp->count; i++) {
+        dest += network_pack_params(cp->networks[i], dest);
+    }
+
+    pthread_mutex_lock(&cp->lock);
+    cp->snapshots[slot].sequence = sequence;
+    cp->pending = slot;
+    pthread_cond_signal(&cp->wake);
+    pthread_mutex_unlock(&cp->lock);
+}
+
+// waits until every snapshot taken so far is on disk (or failed)
+void Checkpointer_flush(Checkpointer *cp) {
+    pthread_mutex_lock(&cp->lock);
+    while (cp->pending >= 0 || cp->writing >= 0) {
+        pthread_cond_wait(&cp->idle, &cp->lock);
+    }
+    pthread_mutex_unlock(&cp->lock);
+}
+
+// loads the newest checkpoint on disk into the networks, the full one plus its delta if there is one,
+// and continues the sequence from it; returns false and leaves the networks alone if there is none
+bool Checkpointer_restore(Checkpointer *cp) {
+    Checkpointer_flush(cp);
+    char path[4200];
+    uint64_t full[CHECKPOINT_FIELDS], delta[CHECKPOINT_FIELDS];
+    uint64_t fullHash, deltaHash;
+    size_t bytes = 0;
+    snprintf(path, sizeof(path), "%s.ckpt", cp->path);
+    unsigned char *params = checkpointer_read_file(cp, path, full, &fullHash, &bytes);
+    if (!params)
+        return false;
+    if (full[0] != CHECKPOINT_FULL || full[3] != fullHash || bytes != cp->paramCount * sizeof(float)) {
+        fprintf(stderr, "Invalid checkpoint %s\n", path);
+        free(params);
+        return false;
+    }
+
+    pthread_mutex_lock(&cp->lock);
+    memcpy(cp->base, params, bytes);
+    free(params);
+    float *restored = cp->base;
+    cp->baseSequence = full[1];
+    cp->baseHash = fullHash;
+    cp->sinceFull = 0;
+    if (cp->sequence < full[1])
+        cp->sequence = full[1];
+    snprintf(path, sizeof(path), "%s.delta.ckpt", cp->path);
+    unsigned char *encoded = checkpointer_read_file(cp, path, delta, &deltaHash, &bytes);
+    // a delta left over from another run can share the base sequence, never the base hash
+    if (encoded && delta[0] == CHECKPOINT_DELTA && delta[2] == full[1] && delta[3] == fullHash && delta[1] > full[1]) {
+        // the writer is idle, so a snapshot buffer is free to decode into
+        float *dest = cp->snapshots[0].params;
+        if (checkpoint_decode(encoded, bytes, cp->base, dest, cp->paramCount)) {
+            restored = dest;
+            if (cp->sequence < delta[1])
+                cp->sequence = delta[1];
+            cp->sinceFull = 1;
+        } else {
+            fprintf(stderr, "Invalid checkpoint %s\n", path);
         }
     }
+    free(encoded);
+    for (int i = 0; i < cp->count; i++) {
+        restored += network_unpack_params(cp->networks[i], restored);
+    }
+    pthread_mutex_unlock(&cp->lock);
+    return true;
 }
 
-#endif // _ML_H_
\ No newline at end of file
+#endif // _ML_H_
\ No newline at end of file
@@ -0,0 +1,97 @@
+// Compares matrix_new under the different AllocPolicy settings on access patterns that
+// stress the TLB (random rows of a big replay buffer) and memory locality (batched forward
+// through wide layers).
+//
+// gcc -O2 bench_alloc.c -o bench_alloc -lm -lpthread
+// gcc -O2 -DML_USE_LIBNUMA bench_alloc.c -o bench_alloc -lm -lpthread -lnuma
+//
+// ./bench_alloc > bench_output.txt
+
+#include "ML.h"
+
+#define REPLAY_ROWS (1 << 18)
+#define REPLAY_COLS 128
+#define SAMPLES (1 << 22)
+#define LAYER_WIDTH 2048
+#define BATCH 64
+
+// sums random rows of a replay sized matrix, almost every access is a TLB miss with 4KB pages
+double bench_replay(AllocPolicy policy) {
+    AllocPolicy previous = ml_set_alloc_policy(policy);
+    Matrix replay = matrix_new(REPLAY_ROWS, REPLAY_COLS);
+    ml_set_alloc_policy(previous);
+    matrix_rand(&replay, -1.f, 1.f);
+
+    Rng rng = Rng_new(1, 0);
+    int *rows = malloc(sizeof(*rows) * SAMPLES);
+    Rng_fill_int(&rng, rows, SAMPLES, 0, REPLAY_ROWS - 1);
+
+    volatile float sink = 0.f;
+    double start = ml_time();
+    float sum = 0.f;
+    for (int i = 0; i < SAMPLES; i++) {
+        sum += MAT_AT(&replay, rows[i], i & (REPLAY_COLS - 1));
+    }
+    double elapsed = ml_time() - start;
+    sink = sum;
+    (void) sink;
+
+    free(rows);
+    matrix_free(&replay);
+    return elapsed;
+}
+
+// batched forward through a wide Network allocated under policy
+double bench_forward(AllocPolicy policy) {
+    int arch[] = {LAYER_WIDTH, LAYER_WIDTH, LAYER_WIDTH, 16};
+    ActivationType activations[] = {RELU, RELU, SIGMOID};
+    AllocPolicy previous = ml_set_alloc_policy(policy);
+    Network nn = NeuralNetwork(arch, ARR_LEN(arch), activations);
+    ForwardContext ctx = ForwardContext_new(&nn, BATCH);
+    ml_set_alloc_policy(previous);
+    Network_xavier_init(&nn);
+    matrix_rand(&CONTEXT_IN(&ctx), -1.f, 1.f);
+
+    double start = ml_time();
+    for (int i = 0; i < 4; i++) {
+        Network_forward_ctx(&nn, &ctx);
+    }
+    double elapsed = ml_time() - start;
+
+    ForwardContext_free(&ctx);
+    Network_free(&nn);
+    return elapsed;
+}
+
+void bench(const char *name, AllocPolicy policy) {
+    printf("%-24s replay %8.3fs   forward %8.3fs\n", name, bench_replay(policy), bench_forward(policy));
+}
+
+int main(void) {
+    printf("numa nodes: %d, running on node %d\n", ml_numa_nodes(), ml_current_node());
+
+    AllocPolicy policy = ml_default_alloc_policy();
+    bench("default", policy);
+
+    policy.hugePages = true;
+    bench("huge pages", policy);
+
+    if (ml_numa_nodes() > 1) {
+        policy = ml_default_alloc_policy();
+        policy.node = ml_current_node();
+        bench("local node", policy);
+
+        policy.node = (ml_current_node() + 1) % ml_numa_nodes();
+        bench("remote node", policy);
+
+        policy.node = -1;
+        policy.interleave = true;
+        bench("interleaved", policy);
+
+        policy.hugePages = true;
+        policy.interleave = false;
+        policy.node = ml_current_node();
+        bench("local node + huge pages", policy);
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+// Checks that Network_forward_lanes and Network_forward_soa give the same outputs as
+// Network_forward_ctx for every ActivationType, on row counts that leave the last group of
+// NETWORK_LANES samples partly idle.
+//
+// gcc -O2 check_lanes.c -o check_lanes -lm -lpthread
+//
+// ./check_lanes, exits with 1 if any difference is above TOLERANCE
+
+#include "ML.h"
+
+#define TOLERANCE 1e-5f
+
+// largest absolute difference between the lane results and Network_forward_ctx on `rows` random inputs
+float check_rows(Network *nn, int rows) {
+    int inputs = NETWORK_IN(nn).cols;
+    int outputs = NETWORK_OUT(nn).cols;
+    ForwardContext ctx = ForwardContext_new(nn, rows);
+    matrix_rand(&CONTEXT_IN(&ctx), -3.f, 3.f);
+    Network_forward_ctx(nn, &ctx);
+
+    Matrix out = matrix_new(rows, outputs);
+    Network_forward_lanes(nn, &CONTEXT_IN(&ctx), &out);
+
+    Matrix inT = matrix_new(inputs, rows);
+    Matrix outT = matrix_new(outputs, rows);
+    for (int i = 0; i < rows; i++) {
+        for (int k = 0; k < inputs; k++) {
+            MAT_AT(&inT, k, i) = MAT_AT(&CONTEXT_IN(&ctx), i, k);
+        }
+    }
+    Network_forward_soa(nn, &inT, &outT);
+
+    float worst = 0.f;
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < outputs; j++) {
+            float expected = MAT_AT(&CONTEXT_OUT(&ctx), i, j);
+            float lanes = fabsf(MAT_AT(&out, i, j) - expected);
+            float soa = fabsf(MAT_AT(&outT, j, i) - expected);
+            if (lanes > worst)
+                worst = lanes;
+            if (soa > worst)
+                worst = soa;
+        }
+    }
+
+    matrix_free(&outT);
+    matrix_free(&inT);
+    matrix_free(&out);
+    ForwardContext_free(&ctx);
+    return worst;
+}
+
+int main(void) {
+    const char *names[] = {"SIGMOID", "RELU", "LEAKYRELU", "TANH", "SOFTMAX"};
+    ActivationType types[] = {SIGMOID, RELU, LEAKYRELU, TANH, SOFTMAX};
+    int rowCounts[] = {1, NETWORK_LANES - 1, NETWORK_LANES + 1, 3 * NETWORK_LANES + 5, 1001};
+    int arch[] = {12, LANES_MAX_WIDTH, 37, 5};
+    bool failed = false;
+    rng_seed(1);
+
+    for (int t = 0; t < (int) ARR_LEN(types); t++) {
+        ActivationType activations[] = {types[t], types[t], types[t]};
+        Network nn = NeuralNetwork(arch, ARR_LEN(arch), activations);
+        Network_xavier_init(&nn);
+        for (int i = 0; i < nn.count; i++) {
+            matrix_rand(&nn.biases[i], -1.f, 1.f);
+        }
+
+        for (int r = 0; r < (int) ARR_LEN(rowCounts); r++) {
+            float worst = check_rows(&nn, rowCounts[r]);
+            bool ok = worst <= TOLERANCE;
+            printf("%-10s %5d rows   max difference %.3g   %s\n", names[t], rowCounts[r], worst, ok ? "ok" : "FAILED");
+            failed |= !ok;
+        }
+        Network_free(&nn);
+    }
+    return failed;
+}